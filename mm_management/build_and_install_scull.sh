@@ -11,7 +11,8 @@ echo "Building the module..."
 make
 
 # Insert the module into the kernel
+# Module parameters such as memory_size=1073741824 are passed through
 echo "Inserting the module into the kernel..."
-sudo insmod ${MODULE_NAME}.ko
+sudo insmod ${MODULE_NAME}.ko "$@"
 
 
@@ -5,3 +5,5 @@
 #define SWAP_SPACE_ERROR 14
 #define INVALID_INPUT 15
 
+#define NO_VIRTUAL_SPACE_AVAILABLE 16
+#define PAGE_ALREADY_MAPPED 17
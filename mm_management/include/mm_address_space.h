@@ -0,0 +1,41 @@
+#ifndef MM_ADDRESS_SPACE_H
+#define MM_ADDRESS_SPACE_H
+
+#include <linux/hashtable.h>
+#include <linux/rbtree.h>
+#include "mm_page_frame.h"
+
+/*
+Address space of one pid, the simulator's counterpart of mm_struct
+Each pid has its own root page table and virtual address range allocator (mm_vma.c), frames record the pid so that reclaim can find the address space of a frame
+Address spaces are created on the first allocation of a pid and live until the module is unloaded, only the child of a failed fork is removed earlier
+*/
+
+struct mm_address_space
+{
+	pid_t pid;
+	struct hlist_node as_hash_link; // link to mm_physical_memory.address_spaces
+	
+	uintptr_t cr3_page_table_addr; // root page table, a pinned frame
+	
+	spinlock_t va_lock; // protects the VMAs and the search hints below
+	struct rb_root vma_tree; // reserved ranges keyed by start address
+	struct list_head vma_list; // the same ranges in address order
+	uintptr_t nr_vmas;
+	uintptr_t free_area_cache; // next fit cursor, the search for a free range starts here
+	uintptr_t cached_hole_size; // largest hole passed below free_area_cache, 0 when unknown
+	
+	atomic_long_t nr_mapped_pages; // pages mapped to a frame, a huge page counts as 2^HUGE_PAGE_ORDER pages
+	atomic_long_t nr_page_tables; // page table pages below the root
+	atomic_long_t nr_faults; // swap-in faults
+	atomic_long_t nr_demand_faults; // first touches of pages reserved with MM_VM_LAZY
+	atomic_long_t nr_cow_faults; // writes to pages shared copy-on-write
+};
+
+struct mm_address_space * mm_find_address_space(struct mm_physical_memory *, pid_t pid);
+struct mm_address_space * mm_get_address_space(struct mm_physical_memory *, pid_t pid);
+void mm_remove_address_space(struct mm_physical_memory *, struct mm_address_space * as);
+void mm_address_spaces_uninit(struct mm_physical_memory *);
+void mm_address_spaces_print_stats(struct mm_physical_memory *);
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef MM_FORK_H
+#define MM_FORK_H
+
+#include "mm_address_space.h"
+
+int mm_fork(struct mm_physical_memory *, pid_t child_pid);
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef MM_KSM_H
+#define MM_KSM_H
+
+#include <linux/hashtable.h>
+#include "mm_page_frame.h"
+
+#define MM_KSM_DEFAULT_PAGES_TO_SCAN 100 // frames checked per pass of the scanner
+#define MM_KSM_DEFAULT_SLEEP_MS 20 // pause between two passes
+#define MM_KSM_HASH_BITS 8
+
+/*
+Frame whose contents were found on more than one page and which now backs all of them read only
+The node holds a reference to the frame, so the frame can neither be reused nor evicted while it is shared
+*/
+
+struct ksm_stable_node
+{
+	struct hlist_node s_hash_link; // link to mm_ksm.stable_hash
+	u32 checksum;
+	struct mm_page_frame * p_frame;
+};
+
+/*
+Frame seen with the same checksum on two passes in a row, a merge candidate for the rest of the full scan
+No reference is held, the frame is checked again before it is merged
+*/
+
+struct ksm_rmap_item
+{
+	struct hlist_node u_hash_link; // link to mm_ksm.unstable_hash
+	u32 checksum;
+	struct mm_page_frame * p_frame;
+};
+
+/*
+Same page merging scanner
+Everything is only touched by the scanner thread, the counters are read racily for the statistics
+*/
+
+struct mm_ksm
+{
+	struct mm_physical_memory * mem;
+	struct task_struct * ksmd;
+	unsigned int pages_to_scan;
+	unsigned int sleep_ms;
+	struct mm_page_frame ** batch; // frames picked by one pass
+	
+	DECLARE_HASHTABLE(stable_hash, MM_KSM_HASH_BITS); // struct ksm_stable_node keyed by checksum
+	DECLARE_HASHTABLE(unstable_hash, MM_KSM_HASH_BITS); // struct ksm_rmap_item keyed by checksum, emptied after every full scan
+	uintptr_t scan_remaining; // frames left to check in the current full scan of alloc_pages
+	
+	uintptr_t nr_pages_shared; // stable frames
+	uintptr_t nr_pages_sharing; // mappings of stable frames beyond the first of each, i.e. frames saved
+	uintptr_t nr_merged;
+	uintptr_t nr_pages_scanned;
+	uintptr_t nr_full_scans;
+};
+
+int mm_ksm_init(struct mm_physical_memory *, unsigned int pages_to_scan, unsigned int sleep_ms);
+void mm_ksm_uninit(void);
+void mm_ksm_print_stats(void);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef MM_KSWAPD_H
+#define MM_KSWAPD_H
+
+#include "mm_page_frame.h"
+
+#define MM_WMARK_MIN_RATIO 64 // wmark_min is total_pages / MM_WMARK_MIN_RATIO, at least one frame
+
+int mm_kswapd_init(struct mm_physical_memory *);
+void mm_kswapd_uninit(struct mm_physical_memory *);
+void mm_kswapd_wakeup(struct mm_physical_memory *);
+void mm_kswapd_print_stats(struct mm_physical_memory *);
+
+/*
+This function wakes kswapd once an allocation has taken nr_free_pages below the low watermark
+nr_free_pages is read without free_area_lock, a stale value only delays or repeats a wakeup
+*/
+
+static inline void mm_kswapd_check_wmark(struct mm_physical_memory * mem)
+{
+	if(READ_ONCE(mem->nr_free_pages) < mem->wmark_low)
+	{
+		mm_kswapd_wakeup(mem);
+	}
+}
+
+#endif
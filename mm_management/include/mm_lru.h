@@ -0,0 +1,17 @@
+#ifndef MM_LRU_H
+#define MM_LRU_H
+
+#include "mm_page_frame.h"
+
+#define MM_LRU_AGING_INTERVAL_MS 1000 // period of the background aging pass
+#define MM_LRU_AGING_BATCH 32 // frames looked at per list by one aging pass
+
+void lru_add_locked(struct mm_physical_memory *, struct mm_page_frame * p_frame);
+void lru_del_locked(struct mm_physical_memory *, struct mm_page_frame * p_frame);
+void mm_lru_age(struct mm_physical_memory *, uintptr_t nr_to_scan);
+uintptr_t mm_lru_isolate_victims(struct mm_physical_memory *, struct mm_page_frame ** p_frames, uintptr_t nr_frames);
+void mm_lru_init(struct mm_physical_memory *);
+void mm_lru_uninit(struct mm_physical_memory *);
+void mm_lru_print_stats(struct mm_physical_memory *);
+
+#endif
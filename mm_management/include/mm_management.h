@@ -1,39 +1,119 @@
+#ifndef MM_MANAGEMENT_H
+#define MM_MANAGEMENT_H
+
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/hashtable.h>
 #include "../error_types.h"
 
 //#DEFINE TOTAL_MEMORY (10*1024*1024)
-#define TOTAL_MEMORY_EXP (20*1024)
-#define PAGE_SIZE_EXP (4*1024)
+#define TOTAL_MEMORY_EXP (20*1024) // default size of the simulated memory, see the memory_size module parameter
+#define PAGE_SIZE_EXP (4*1024) // the only page size the 12 bit page offset of the page tables supports
 
 #define PF_DIRTY 0x01
 #define PF_BUSY 0x02
 #define PF_PINNED 0x04
+#define PF_ALLOCATED 0x08
+#define PF_BUDDY 0x10 // first frame of a free block on one of the free_area lists
+#define PF_HUGE 0x20 // first frame of a block mapped by a single huge PTE
+#define PF_ACTIVE 0x40 // frame is on active_pages, otherwise an allocated order-0 frame is on in_active_pages
+#define PF_READAHEAD 0x80 // frame was swapped in by readahead and has not been accessed since
+
+#define MM_MAX_ORDER 10 // largest block handed out by the buddy allocator is 2^MM_MAX_ORDER frames
+
+#define MM_PCP_BATCH 16 // frames moved between a per-cpu list and the buddy allocator at a time
+#define MM_PCP_HIGH (4*MM_PCP_BATCH) // a per-cpu list is drained once it holds this many frames
+
+#define MM_AS_HASH_BITS 6
 
 struct mm_page_frame;
+struct mm_tlb;
+struct mm_pwc;
+struct task_struct;
+
+struct mm_free_area
+{
+	struct list_head free_list; // first frames of the free blocks of this order
+	uintptr_t nr_free; // number of free blocks of this order
+};
+
+struct mm_per_cpu_pages
+{
+	spinlock_t lock; // only contended when another cpu drains this list
+	struct list_head frames; // free order-0 frames, hot frames at the head and cold frames at the tail
+	unsigned int count;
+};
+
+/*
+Lock order, outermost first:
+swap_space_mutex -> alloc_lists_lock -> lru_lock -> page table lock (mm_page_frame.ptl) -> free_area_lock
+Where two page table locks are held, the lock of the parent table is taken before the lock of its child,
+and fork takes the lock of a table of the forking address space before the lock of the matching table of the new one
+A frame shared copy-on-write is kept allocated by its pf_refcount, eviction only takes frames whose single reference it can freeze
+The per-cpu list locks, the TLB and paging-structure cache locks, address_spaces_lock and mm_address_space.va_lock are innermost and never held while taking another lock
+swap_space_mutex is the only sleeping lock, and no lock is held across get_free_pages() since it may reclaim
+PTE reference bits are set and cleared with atomic bit operations and need no lock
+Translations walk the page tables under rcu_read_lock() only, so PTEs are read with READ_ONCE() and written with WRITE_ONCE(),
+and a page table page is only freed after a grace period (free_page_table_rcu())
+The pf_flags of a frame on the LRU are only changed under lru_lock
+*/
 
 struct mm_physical_memory
 {
-	uintptr_t memory_addr_start;
+	uintptr_t memory_addr_start; // vmalloc()ed, so the simulated memory is only virtually contiguous
 	uintptr_t total_pages;
 	
-	uintptr_t cr3_page_table_addr;
+	spinlock_t address_spaces_lock; // serialises creation of address spaces, lookups only need rcu_read_lock()
+	DECLARE_HASHTABLE(address_spaces, MM_AS_HASH_BITS); // struct mm_address_space keyed by pid
+	
+	struct mm_page_frame * pframes; // frame descriptors indexed by (physical address - memory_addr_start) >> 12
+	
+	struct mm_free_area free_area[MM_MAX_ORDER + 1]; // buddy allocator free lists, indexed by order
+	uintptr_t nr_free_pages;
+	
+	struct mm_per_cpu_pages __percpu * pcp; // per-cpu caches of free order-0 frames in front of the buddy allocator
 	
-	struct list_head free_pages;
+	spinlock_t free_area_lock; // protects the buddy allocator free areas and nr_free_pages
+	
+	spinlock_t alloc_lists_lock; // protects alloc_pages, nr_alloc_pages and pinned_pages
 	struct list_head alloc_pages;
+	uintptr_t nr_alloc_pages;
 	struct list_head pinned_pages;
 	
-	struct list_head active_pages;
-	struct list_head in_active_pages;
+	struct mm_tlb * tlb; // simulated TLB in front of virtual_to_physical_address()
+	struct mm_pwc * pwc; // paging-structure cache for the upper levels of page table walks
+	
+	spinlock_t lru_lock; // protects the LRU lists and counters
+	struct list_head active_pages; // LRU of allocated order-0 frames
+	struct list_head in_active_pages; // eviction candidates, reclaim takes from the tail
+	uintptr_t nr_active_pages;
+	uintptr_t nr_in_active_pages;
+	struct delayed_work lru_aging_work;
 	
-	struct mutex mm_memory_mutex;
+	uintptr_t wmark_min; // below this allocators reclaim directly
+	uintptr_t wmark_low; // below this kswapd is woken
+	uintptr_t wmark_high; // kswapd reclaims until nr_free_pages reaches this
+	struct task_struct * kswapd; // background reclaim thread
+	wait_queue_head_t kswapd_wait;
+	bool kswapd_pending; // set by mm_kswapd_wakeup(), cleared by kswapd before it balances
+	uintptr_t nr_kswapd_reclaimed;
+	atomic_long_t nr_direct_reclaimed;
+	
+	spinlock_t pt_free_lock; // protects the two lists below and pt_free_queued
+	struct list_head pt_free_pending; // unlinked page table frames that still need a grace period
+	struct list_head pt_free_waiting; // unlinked page table frames waiting for the grace period of pt_free_work
+	bool pt_free_queued;
+	struct rcu_work pt_free_work;
 };
 
 
 
 
 //void print_list(void);
-int initialize_memory(struct mm_physical_memory *);
-//int uninitialize_memory(void);
-
+int initialize_memory(struct mm_physical_memory **, uintptr_t memory_size, unsigned int page_size);
+void uninitialize_memory(struct mm_physical_memory *);
 
+#endif
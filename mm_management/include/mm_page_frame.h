@@ -1,11 +1,33 @@
+#ifndef MM_PAGE_FRAME_H
+#define MM_PAGE_FRAME_H
+
 #include <linux/sched.h>
+#include <linux/rcupdate.h>
 #include "mm_management.h"
+#include "mm_tlb.h"
+#include "mm_pwc.h"
 
 #define PAGE_FAULT_NO_PAGE 0x01
 #define PAGE_FAULT_INVALID_PTE 0x02
 
+#define PTE_PFN_MASK 0x000FFFFFFFFFFFFF // bits 0-51 hold the physical frame number
+#define PTE_VALID 0x0010000000000000
+#define PTE_REFERENCE 0x0020000000000000
+#define PTE_REFERENCE_BIT 53 // bit number of PTE_REFERENCE for the atomic bit operations
+#define PTE_HUGE 0x0040000000000000 // level 3 entry maps a HUGE_PAGE_SIZE_EXP run directly instead of pointing to a level 4 table
+#define PTE_READ_ONLY 0x0080000000000000 // level 4 entry of a frame shared copy-on-write, a write through it faults
+#define PTE_READ_ONLY_BIT 55
+
+#define HUGE_PAGE_ORDER 9
+#define HUGE_PAGE_SIZE_EXP (PAGE_SIZE_EXP << HUGE_PAGE_ORDER) // 2 MiB
+
+#define PAGE_WALK_HUGE 1 // returned by get_multilevel_pagetables() when a huge entry ended the walk
+#define PAGE_WALK_FAULT 2 // returned by a lockless walk that found an invalid entry, the fault is handled outside rcu_read_lock()
+#define PAGE_WALK_RETRY 3 // the page table was unlinked under the walk because it became empty, the walk restarts from the root
+#define PAGE_WALK_WRITE_PROTECT 4 // returned by a lockless walk for a write that found a PTE_READ_ONLY entry, the copy-on-write fault is handled outside rcu_read_lock()
+
 
-extern uintptr_t latest_virtual_address;
+struct mm_address_space;
 
 struct mm_page_frame
 {
@@ -15,11 +37,20 @@ struct mm_page_frame
 	struct list_head pf_link; // link on free,allocated and pinned list
 	struct list_head pf_scheduler_link; // link on active, inactive scheduler lists
 	
-	uint8_t pf_flags; // PF_DIRTY, PF_BUSY, PF_PINNED;
+	uint8_t pf_flags; // PF_DIRTY, PF_BUSY, PF_PINNED, PF_ALLOCATED, PF_BUDDY;
+	uint8_t order; // size of the block this frame heads is 2^order frames
 	
 	uintptr_t virtual_start_address; // used for reverse mapping
-	pid_t pid; // used for reverse mapping
-};
+	pid_t pid; // used for reverse mapping, names one of the mappers of a shared frame and may be stale once the others unmapped it
+	
+	atomic_t pf_refcount; // mappings plus temporary references of an allocated frame, it is freed when this drops to zero
+	atomic_t pf_mapcount; // PTEs mapping the frame, more than one once fork or the KSM scanner shares it copy-on-write
+	u32 pf_checksum; // contents checksum of the last pass of the KSM scanner, only used by the scanner
+	
+	spinlock_t ptl; // protects the entries of this frame while it holds a page table
+	uint16_t pt_nr_used; // valid entries of the page table, protected by ptl
+	bool pt_unlinked; // the empty page table was unlinked from its parent entry and waits for free_page_table_rcu(), protected by ptl
+} ____cacheline_aligned;
 
 struct swap_meta_data
 {
@@ -27,20 +58,105 @@ struct swap_meta_data
 	uintptr_t virtual_pframe_addr;
 };
 
+/*
+Returns the frame descriptor of the page frame that contains the given physical address
+*/
+
+static inline struct mm_page_frame * phys_to_pframe(struct mm_physical_memory * mem, uintptr_t physical_addr)
+{
+	return &mem->pframes[(physical_addr - mem->memory_addr_start) >> 12];
+}
+
+static inline uintptr_t pframe_index(struct mm_physical_memory * mem, struct mm_page_frame * p_frame)
+{
+	return p_frame - mem->pframes;
+}
+
+static inline bool is_valid_physical_address(struct mm_physical_memory * mem, uintptr_t physical_addr)
+{
+	return physical_addr >= mem->memory_addr_start && ((physical_addr - mem->memory_addr_start) >> 12) < mem->total_pages;
+}
+
+/*
+Returns the lock protecting the entries of the page table that starts at page_table_addr
+*/
+
+static inline spinlock_t * pte_lockptr(struct mm_physical_memory * mem, uintptr_t page_table_addr)
+{
+	return &phys_to_pframe(mem, page_table_addr)->ptl;
+}
+
+/*
+Sets the reference bit of a PTE the way the hardware sets the accessed bit, atomically and without the page table lock
+*/
+
+static inline void pte_set_referenced(uintptr_t * pte_address)
+{
+	set_bit(PTE_REFERENCE_BIT, (unsigned long *)pte_address);
+}
+
+/*
+This function returns the address of the entry of vfn in the page table of the given level (1-4) that starts at page_table_addr
+*/
+
+static inline uintptr_t * get_PTE_address(uintptr_t vfn, uintptr_t level, uintptr_t page_table_addr)
+{
+	uintptr_t ind = 0;
+	
+	switch(level)
+	{
+		case 1: ind = (vfn &  0xFF8000000) >> 27; //Extract 27-35 bits of vfn
+			break;
+		
+		case 2: ind = (vfn &  0x07FC0000) >> 18; //Extract 18-26 bits of vfn
+			break;
+			
+		case 3: ind = (vfn &  0x03FE00) >> 9; //Extract 9-17 bits of vfn
+			break;
+			
+		case 4: ind = (vfn &  0x01FF); //Extract 0-8 bits of vfn
+			break;
+	}
+	
+	return (uintptr_t *)page_table_addr + ind;
+}
+
 int initialize_pframes(struct mm_physical_memory *);
 
-struct mm_page_frame * pframe_init(int i, struct mm_physical_memory *);
+struct mm_page_frame * pframe_init(uintptr_t i, struct mm_physical_memory *);
+struct mm_page_frame * get_free_pages(struct mm_physical_memory *, unsigned int order, bool pinned_page_flag);
 struct mm_page_frame * get_free_page_internal(struct mm_physical_memory *, bool pinned_page_flag);
+void buddy_free_locked(struct mm_physical_memory *, struct mm_page_frame * p_frame, unsigned int order);
+void free_pcp_page(struct mm_physical_memory *, struct mm_page_frame * p_frame, bool cold);
+uintptr_t drain_all_pcp(struct mm_physical_memory *);
+int get_free_pages_bulk(struct mm_physical_memory *, uintptr_t nr_pages, struct list_head * frames);
+void free_pages_bulk(struct mm_physical_memory *, struct list_head * frames);
 inline uintptr_t set_PTE(uintptr_t pfn);
 inline uintptr_t set_PTE_Reference_bit(uintptr_t pfn);
 int get_free_page(struct mm_physical_memory * mem, uintptr_t * addr);
+int get_free_huge_page(struct mm_physical_memory * mem, uintptr_t * addr);
+int mm_map_range(struct mm_physical_memory * mem, uintptr_t nr_pages, uintptr_t * addr);
+int get_free_page_lazy(struct mm_physical_memory * mem, uintptr_t * addr);
+int mm_map_range_lazy(struct mm_physical_memory * mem, uintptr_t nr_pages, uintptr_t * addr);
+int mm_demand_page_fault(struct mm_physical_memory * mem, pid_t pid, uintptr_t virtual_pframe_addr);
+int mm_unmap_range(struct mm_physical_memory * mem, uintptr_t virtual_addr, uintptr_t nr_pages);
+int mm_unmap_range_as(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t virtual_addr, uintptr_t nr_pages);
 int free_page_internal(struct mm_physical_memory *, uintptr_t physical_addr, bool pinned_page_flag);
 int mm_free_page(struct mm_physical_memory * mem, uintptr_t virtual_addr);
 
 int virtual_to_physical_address(struct mm_physical_memory *, uintptr_t virtual_address, uintptr_t * physical_addr);
+int virtual_to_physical_address_write(struct mm_physical_memory *, uintptr_t virtual_address, uintptr_t * physical_addr);
+void mm_put_page(struct mm_physical_memory *, struct mm_page_frame * p_frame);
 
-int get_multilevel_pagetables(uintptr_t vfn, uintptr_t level, uintptr_t page_table_addr, uintptr_t * next_page_addr);
-int invalidate_PTE(struct mm_physical_memory *, uintptr_t virtual_page_address);
-int update_multilevel_pagetables(struct mm_physical_memory * mem, uintptr_t vfn, uintptr_t level, uintptr_t page_table_addr, uintptr_t page_frame_physical_addr, uintptr_t * next_page_addr);
-int update_page_table(struct mm_physical_memory *, uintptr_t virtual_address, uintptr_t page_frame_physical_addr);
+int get_leaf_page_table(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t vfn, bool alloc_flag, uintptr_t * page_table_addr);
+int get_multilevel_pagetables(struct mm_physical_memory * mem, uintptr_t vfn, uintptr_t level, uintptr_t page_table_addr, uintptr_t * next_page_addr);
+void free_page_table_rcu(struct mm_physical_memory *, struct mm_page_frame * p_frame);
+void drain_page_table_frees(struct mm_physical_memory *);
+void free_empty_page_tables(struct mm_physical_memory *, struct mm_address_space * as, uintptr_t vfn);
+int invalidate_PTE(struct mm_physical_memory *, struct mm_address_space * as, uintptr_t virtual_page_address);
+void invalidate_PTE_batch(struct mm_physical_memory *, struct mm_page_frame ** p_frames, uintptr_t nr_frames, int * errs);
+int update_multilevel_pagetables(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t vfn, uintptr_t level, uintptr_t page_table_addr, uintptr_t page_frame_physical_addr, struct mm_page_frame ** new_table, uintptr_t * next_page_addr);
+int update_page_table(struct mm_physical_memory *, struct mm_address_space * as, uintptr_t virtual_address, uintptr_t page_frame_physical_addr);
+int update_page_table_huge(struct mm_physical_memory *, struct mm_address_space * as, uintptr_t virtual_address, uintptr_t page_frame_physical_addr);
 
+#endif
@@ -0,0 +1,41 @@
+#ifndef MM_PWC_H
+#define MM_PWC_H
+
+#include <linux/atomic.h>
+#include "mm_management.h"
+
+#define MM_PWC_ENTRIES 16 // entries per cached level, direct mapped
+
+#define MM_PWC_LEVEL3 0 // caches vfn >> 18 -> level 3 page table
+#define MM_PWC_LEVEL4 1 // caches vfn >> 9 -> level 4 page table
+
+struct mm_pwc_entry
+{
+	uintptr_t root; // root page table the walk started at
+	uintptr_t tag; // upper vfn bits translated by the skipped levels
+	uintptr_t page_table_addr;
+	bool valid;
+};
+
+/*
+Paging-structure cache, caches the upper levels of page table walks the way the hardware PDPTE/PDE caches do
+*/
+
+struct mm_pwc
+{
+	struct mm_pwc_entry entries[2][MM_PWC_ENTRIES]; // indexed by MM_PWC_LEVEL3/MM_PWC_LEVEL4, then tag & (MM_PWC_ENTRIES - 1)
+	
+	spinlock_t lock;
+	
+	atomic64_t hits;
+	atomic64_t misses;
+};
+
+int mm_pwc_init(struct mm_physical_memory *);
+void mm_pwc_uninit(struct mm_physical_memory *);
+bool mm_pwc_lookup(struct mm_pwc *, uintptr_t root, uintptr_t vfn, uintptr_t * page_table_addr, uintptr_t * level);
+void mm_pwc_insert(struct mm_pwc *, uintptr_t root, uintptr_t vfn, uintptr_t level, uintptr_t page_table_addr);
+void mm_pwc_flush_all(struct mm_pwc *);
+void mm_pwc_print_stats(struct mm_pwc *);
+
+#endif
@@ -1,24 +1,82 @@
+#ifndef MM_SWAP_SPACE_H
+#define MM_SWAP_SPACE_H
+
+#include <linux/hashtable.h>
 #include "mm_page_frame.h"
 
+#define MM_SWAP_HASH_BITS 12
+#define MM_SWAP_DEFAULT_SLOTS 1024 // 4 MiB of swap space
+#define MM_SWAP_CLUSTER 16 // most pages evicted by one call of swap_page()
+#define MM_SWAP_RA_MAX_PAGES 64 // upper bound of the swap readahead window
+#define MM_SWAP_RA_DEFAULT_PAGES 8
+
+struct swap_block;
+struct kmem_cache;
+
 struct swap_space
 {
+	void * slots_data; // nr_slots page sized slots, allocated once when the module is loaded
+	struct swap_block * blocks; // blocks[i] describes slot i
+	unsigned long * slot_bitmap; // set bits are slots holding a swapped out page
+	uintptr_t nr_slots;
+	uintptr_t nr_used_slots;
+	uintptr_t next_slot; // next fit hint for the slot search
+	
+	unsigned int ra_max_pages; // readahead window limit, 1 disables readahead
+	unsigned int ra_prev_win;
+	uintptr_t ra_prev_addr; // last faulting address, a fault next to it counts as sequential
+	atomic_t ra_hits; // readahead pages accessed since the last swap-in fault
+	atomic64_t ra_pages; // pages swapped in by readahead
+	atomic64_t ra_hits_total;
+	
 	struct list_head swap_blocks;
+	DECLARE_HASHTABLE(swap_hash, MM_SWAP_HASH_BITS); // swap blocks keyed by swap_key(pid, virtual_pframe_addr)
+	
+	struct kmem_cache * sf_cache; // struct swap_sf_entry
+	DECLARE_HASHTABLE(sf_hash, MM_SWAP_HASH_BITS); // same filled pages keyed by swap_key(pid, virtual_pframe_addr)
+	uintptr_t nr_same_filled; // pages currently held as their fill value
+	uintptr_t nr_same_filled_total;
+	
 	struct mutex swap_space_mutex;
 };
 
 struct swap_block
 {
 	struct list_head ss_link; // link to swap_space.swap_blocks
+	struct hlist_node ss_hash_link; // link to swap_space.swap_hash
 	uintptr_t virtual_pframe_addr;
 	pid_t pid;
-	void * data;
+	void * data; // the slot of this block in slots_data
+};
+
+/*
+Swapped out page whose words all hold the same value, only the value is kept
+*/
+
+struct swap_sf_entry
+{
+	struct hlist_node sf_hash_link; // link to swap_space.sf_hash
+	uintptr_t virtual_pframe_addr;
+	pid_t pid;
+	unsigned long value;
 };
 
 extern struct swap_space * swap_sp;
 
-void initialise_swap_space(void);
+static inline unsigned long swap_key(pid_t pid, uintptr_t virtual_pframe_addr)
+{
+	return (virtual_pframe_addr >> 12) ^ ((unsigned long)pid << 40);
+}
+
+int initialise_swap_space(uintptr_t nr_slots, unsigned int ra_max_pages);
+void uninitialise_swap_space(void);
 void print_swap_space(void);
-int swap_page(struct mm_physical_memory *);
+void print_swap_stats(void);
+void swap_ra_hit(struct mm_physical_memory *, struct mm_page_frame * p_frame);
+int swap_page(struct mm_physical_memory *, uintptr_t nr_pages, bool direct_reclaim);
 int handle_page_fault(struct mm_physical_memory *, int cmd, void * data);
 int get_swap_space_data(struct mm_physical_memory *, void * meta_data);
+void swap_discard_range(pid_t pid, uintptr_t virtual_addr, uintptr_t nr_pages);
+int swap_dup_range(pid_t pid, pid_t new_pid, uintptr_t virtual_addr, uintptr_t nr_pages);
 
+#endif
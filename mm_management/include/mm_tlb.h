@@ -0,0 +1,45 @@
+#ifndef MM_TLB_H
+#define MM_TLB_H
+
+#include <linux/atomic.h>
+#include <linux/log2.h>
+#include "mm_management.h"
+
+#define MM_TLB_DEFAULT_ENTRIES 64
+#define MM_TLB_DEFAULT_WAYS 4
+
+#define MM_TLB_ALL_PIDS ((pid_t)-1) // matches the entries of every pid when flushing
+
+struct mm_tlb_entry
+{
+	pid_t pid;
+	uintptr_t vfn;
+	uintptr_t pfn;
+	bool valid;
+	bool writable; // cached from a write access, a read access never makes an entry writable
+};
+
+struct mm_tlb
+{
+	struct mm_tlb_entry * entries; // nr_sets * nr_ways entries, the ways of a set are adjacent
+	unsigned int * next_victim; // round robin replacement pointer of every set
+	unsigned int nr_sets; // power of two, the set of a translation is vfn & (nr_sets - 1)
+	unsigned int nr_ways;
+	
+	spinlock_t lock;
+	
+	atomic64_t hits;
+	atomic64_t misses;
+	atomic64_t shootdowns;
+};
+
+int mm_tlb_init(struct mm_physical_memory *, unsigned int nr_entries, unsigned int nr_ways);
+void mm_tlb_uninit(struct mm_physical_memory *);
+bool mm_tlb_lookup(struct mm_tlb *, pid_t pid, uintptr_t vfn, bool write, uintptr_t * pfn);
+void mm_tlb_insert(struct mm_tlb *, pid_t pid, uintptr_t vfn, uintptr_t pfn, bool writable);
+void mm_tlb_flush_page(struct mm_tlb *, pid_t pid, uintptr_t vfn);
+void mm_tlb_flush_range(struct mm_tlb *, pid_t pid, uintptr_t vfn, uintptr_t nr_pages);
+void mm_tlb_flush_all(struct mm_tlb *);
+void mm_tlb_print_stats(struct mm_tlb *);
+
+#endif
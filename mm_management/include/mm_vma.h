@@ -0,0 +1,32 @@
+#ifndef MM_VMA_H
+#define MM_VMA_H
+
+#include <linux/rbtree.h>
+#include "mm_address_space.h"
+
+#define MM_VMA_BASE 0x0000000000000000UL // lowest address handed out in an address space
+#define MM_VMA_END (1UL << 47) // end of the lower half of the 48 bit virtual address space walked by the 4 level page tables
+
+#define MM_VM_LAZY 0x01 // pages are not backed by a frame until their first translation fault, see mm_demand_page_fault()
+
+/*
+Reserved virtual address range [vm_start, vm_end) of an address space
+Adjacent reservations with the same vm_flags are merged, so a VMA covers any number of earlier allocations
+*/
+
+struct mm_vma
+{
+	struct rb_node vm_rb; // link to mm_address_space.vma_tree, keyed by vm_start
+	struct list_head vm_link; // link to mm_address_space.vma_list, in address order
+	uintptr_t vm_start;
+	uintptr_t vm_end;
+	unsigned long vm_flags; // MM_VM_LAZY
+};
+
+int mm_mmap(struct mm_address_space *, uintptr_t nr_pages, uintptr_t align, unsigned long vm_flags, uintptr_t * addr);
+int mm_munmap(struct mm_address_space *, uintptr_t addr, uintptr_t nr_pages);
+int mm_vma_lookup_flags(struct mm_address_space *, uintptr_t addr, unsigned long * vm_flags);
+int mm_vma_dup(struct mm_address_space * dst, struct mm_address_space * src);
+void mm_vma_uninit(struct mm_address_space *);
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef MM_ZSWAP_H
+#define MM_ZSWAP_H
+
+#include <linux/hashtable.h>
+#include "mm_page_frame.h"
+
+#define MM_ZSWAP_CLASS_SIZE 256
+#define MM_ZSWAP_NR_CLASSES 8 // size classes of 256 .. 2048 bytes
+#define MM_ZSWAP_MAX_LENGTH (MM_ZSWAP_CLASS_SIZE * MM_ZSWAP_NR_CLASSES) // pages that do not compress below this go to a swap slot
+#define MM_ZSWAP_HASH_BITS 12
+
+struct zswap_entry
+{
+	struct hlist_node z_hash_link; // link to mm_zswap.z_hash
+	uintptr_t virtual_pframe_addr;
+	pid_t pid;
+	unsigned short length; // compressed length of data
+	unsigned char size_class;
+	u8 data[];
+};
+
+/*
+Compressed swap tier in front of the swap slots
+Evicted pages are LZ4 compressed and kept in the kmem_cache of the smallest size class that fits them
+Everything except the load counters is protected by swap_space_mutex
+*/
+
+struct mm_zswap
+{
+	struct kmem_cache * classes[MM_ZSWAP_NR_CLASSES];
+	DECLARE_HASHTABLE(z_hash, MM_ZSWAP_HASH_BITS); // entries keyed by swap_key(pid, virtual_pframe_addr)
+	
+	void * workmem; // LZ4 compression state
+	u8 * buffer; // compression output, copied into an entry once its size class is known
+	
+	uintptr_t nr_stored; // pages currently held compressed
+	uintptr_t nr_rejected; // did not compress below MM_ZSWAP_MAX_LENGTH
+	uintptr_t nr_alloc_failed;
+	uintptr_t class_count[MM_ZSWAP_NR_CLASSES];
+	u64 original_bytes;
+	u64 compressed_bytes;
+	u64 compress_ns;
+	
+	atomic64_t nr_loads;
+	atomic64_t decompress_ns;
+};
+
+extern struct mm_zswap * zswap;
+
+int mm_zswap_init(void);
+void mm_zswap_uninit(void);
+int mm_zswap_store_locked(pid_t pid, uintptr_t virtual_pframe_addr, const void * src);
+struct zswap_entry * mm_zswap_lookup_locked(pid_t pid, uintptr_t virtual_pframe_addr);
+int mm_zswap_dup_locked(pid_t pid, uintptr_t virtual_pframe_addr, pid_t new_pid);
+void mm_zswap_insert_locked(struct zswap_entry * entry);
+void mm_zswap_drop_locked(pid_t pid, uintptr_t virtual_pframe_addr);
+int mm_zswap_load(struct zswap_entry * entry, void * dst);
+void mm_zswap_free_entry(struct zswap_entry * entry);
+void mm_zswap_print_stats(void);
+
+#endif
@@ -0,0 +1,163 @@
+#include "../include/mm_vma.h"
+
+/*
+This function finds the address space of pid
+The address spaces are not freed while the module is loaded, so the result stays valid after the RCU read side critical section
+The only exception is the child of a failed fork, which nothing but the fork uses (mm_remove_address_space())
+Returns NULL if pid has no address space yet
+*/
+
+struct mm_address_space * mm_find_address_space(struct mm_physical_memory * mem, pid_t pid)
+{
+	struct mm_address_space * as;
+	
+	rcu_read_lock();
+	hash_for_each_possible_rcu(mem->address_spaces, as, as_hash_link, pid)
+	{
+		if(as->pid == pid)
+		{
+			rcu_read_unlock();
+			return as;
+		}
+	}
+	rcu_read_unlock();
+	
+	return NULL;
+}
+
+
+/*
+This function finds the address space of pid and creates it with an empty root page table if pid has none
+The root is allocated before taking address_spaces_lock since allocating may reclaim, the loser of a race with another creator frees its copy
+Returns NULL if no frame is available for the root page table
+*/
+
+struct mm_address_space * mm_get_address_space(struct mm_physical_memory * mem, pid_t pid)
+{
+	struct mm_address_space * as = mm_find_address_space(mem, pid);
+	struct mm_address_space * new_as;
+	struct mm_page_frame * root;
+	
+	if(as)
+	{
+		return as;
+	}
+	
+	new_as = kzalloc( sizeof(struct mm_address_space), GFP_KERNEL);
+	if(!new_as)
+	{
+		printk(KERN_ERR "mm_management : Error allocating struct mm_address_space\n");
+		return NULL;
+	}
+	
+	root = get_free_page_internal(mem, 1);
+	if(!root)
+	{
+		kfree(new_as);
+		return NULL;
+	}
+	memset((void *)root->physical_start_address, 0, PAGE_SIZE_EXP);
+	root->pt_nr_used = 0;
+	root->pt_unlinked = false;
+	
+	new_as->pid = pid;
+	new_as->cr3_page_table_addr = root->physical_start_address;
+	spin_lock_init(&new_as->va_lock);
+	new_as->vma_tree = RB_ROOT;
+	INIT_LIST_HEAD(&new_as->vma_list);
+	new_as->nr_vmas = 0;
+	new_as->free_area_cache = MM_VMA_BASE;
+	new_as->cached_hole_size = 0;
+	atomic_long_set(&new_as->nr_mapped_pages, 0);
+	atomic_long_set(&new_as->nr_page_tables, 0);
+	atomic_long_set(&new_as->nr_faults, 0);
+	atomic_long_set(&new_as->nr_demand_faults, 0);
+	atomic_long_set(&new_as->nr_cow_faults, 0);
+	
+	spin_lock(&mem->address_spaces_lock);
+	
+	hash_for_each_possible(mem->address_spaces, as, as_hash_link, pid)
+	{
+		if(as->pid == pid)
+		{
+			spin_unlock(&mem->address_spaces_lock);
+			free_page_internal(mem, root->physical_start_address, 1);
+			kfree(new_as);
+			return as;
+		}
+	}
+	
+	hash_add_rcu(mem->address_spaces, &new_as->as_hash_link, pid);
+	
+	spin_unlock(&mem->address_spaces_lock);
+	
+	printk("mm_management : Created address space of pid:%d, root:%lx\n", pid, new_as->cr3_page_table_addr);
+	
+	return new_as;
+}
+
+
+/*
+This function removes as from the lookup table and frees it together with its VMAs and root page table
+Lookups that may have found it are waited for, but the caller must make sure no other user of as is left, like the child of a failed fork
+that never ran, and that everything as mapped was unmapped before
+*/
+
+void mm_remove_address_space(struct mm_physical_memory * mem, struct mm_address_space * as)
+{
+	spin_lock(&mem->address_spaces_lock);
+	hash_del_rcu(&as->as_hash_link);
+	spin_unlock(&mem->address_spaces_lock);
+	
+	synchronize_rcu();
+	
+	if(atomic_long_read(&as->nr_mapped_pages) || atomic_long_read(&as->nr_page_tables))
+	{
+		printk(KERN_ERR "mm_management : Address space of pid:%d removed while still mapped, pages:%ld, page tables:%ld\n", as->pid,
+			atomic_long_read(&as->nr_mapped_pages), atomic_long_read(&as->nr_page_tables));
+	}
+	
+	mm_vma_uninit(as);
+	
+	// Lockless walks that started at the root before the grace period above are finished, the frame is still freed the same way as other page tables
+	free_page_table_rcu(mem, phys_to_pframe(mem, as->cr3_page_table_addr));
+	
+	printk("mm_management : Removed address space of pid:%d\n", as->pid);
+	
+	kfree(as);
+}
+
+
+/*
+This function frees the address space descriptors when the module is unloaded, no lookup can run concurrently
+*/
+
+void mm_address_spaces_uninit(struct mm_physical_memory * mem)
+{
+	struct mm_address_space * as;
+	struct hlist_node * temp;
+	int bkt;
+	
+	hash_for_each_safe(mem->address_spaces, bkt, temp, as, as_hash_link)
+	{
+		hash_del(&as->as_hash_link);
+		mm_vma_uninit(as);
+		kfree(as);
+	}
+}
+
+
+void mm_address_spaces_print_stats(struct mm_physical_memory * mem)
+{
+	struct mm_address_space * as;
+	int bkt;
+	
+	rcu_read_lock();
+	hash_for_each_rcu(mem->address_spaces, bkt, as, as_hash_link)
+	{
+		printk("mm_management : ADDRESS SPACE : pid:%d, mapped pages:%ld, page tables:%ld, faults:%ld, demand faults:%ld, cow faults:%ld, vmas:%lu\n", as->pid,
+			atomic_long_read(&as->nr_mapped_pages), atomic_long_read(&as->nr_page_tables), atomic_long_read(&as->nr_faults),
+			atomic_long_read(&as->nr_demand_faults), atomic_long_read(&as->nr_cow_faults), READ_ONCE(as->nr_vmas));
+	}
+	rcu_read_unlock();
+}
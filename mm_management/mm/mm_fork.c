@@ -0,0 +1,301 @@
+#include "../include/mm_swap_space.h"
+#include "../include/mm_vma.h"
+#include "../include/mm_fork.h"
+
+/*
+Copy-on-write fork of an address space
+The child gets the VMAs of the parent and level 4 entries pointing at the parent's frames, and both sides' entries are made PTE_READ_ONLY
+so that the first write of either side copies the page (do_wp_page()), pages nobody writes stay shared
+Huge pages are copied at fork since the level 3 entry mapping them has no read only state, swapped out pages get their own copy in swap space
+*/
+
+
+/*
+This function returns the level 3 entry covering vfn in as, or 0 if a table above it is missing
+Caller must hold rcu_read_lock()
+*/
+
+static uintptr_t read_level3_entry(struct mm_address_space * as, uintptr_t vfn)
+{
+	uintptr_t page_table_addr = as->cr3_page_table_addr;
+	
+	for(uintptr_t level = 1; level <= 2; level++)
+	{
+		uintptr_t pte = READ_ONCE(*get_PTE_address(vfn, level, page_table_addr));
+		
+		if( !(pte & PTE_VALID) )
+		{
+			return 0;
+		}
+		page_table_addr = (pte & PTE_PFN_MASK) << 12;
+	}
+	
+	return READ_ONCE(*get_PTE_address(vfn, 3, page_table_addr));
+}
+
+
+/*
+This function gives the child its own copy of the huge page the level 3 entry pte of the parent maps at vfn
+*/
+
+static int copy_huge_page(struct mm_physical_memory * mem, struct mm_address_space * child, uintptr_t vfn, uintptr_t pte)
+{
+	struct mm_page_frame * p_frame = get_free_pages(mem, HUGE_PAGE_ORDER, 0);
+	int err;
+	
+	if(!p_frame)
+	{
+		return -NO_PAGE_FRAME_AVAILABLE;
+	}
+	
+	// The parent is current, which is busy forking and cannot unmap the page meanwhile, and huge pages are never evicted
+	memcpy((void *)p_frame->physical_start_address, (void *)((pte & PTE_PFN_MASK) << 12), HUGE_PAGE_SIZE_EXP);
+	
+	err = update_page_table_huge(mem, child, vfn << 12, p_frame->physical_start_address);
+	if(err)
+	{
+		free_page_internal(mem, p_frame->physical_start_address, 0);
+		return err;
+	}
+	
+	p_frame->pf_flags = p_frame->pf_flags | PF_HUGE;
+	p_frame->virtual_start_address = vfn << 12;
+	p_frame->pid = child->pid;
+	atomic_long_add(1L << HUGE_PAGE_ORDER, &child->nr_mapped_pages);
+	
+	return 0;
+}
+
+
+/*
+This function shares the mapped pages of the nr_pages pages from vfn, which lie in one level 4 page table of the parent, with the child
+*/
+
+static int copy_pte_range(struct mm_physical_memory * mem, struct mm_address_space * parent, struct mm_address_space * child, uintptr_t vfn, uintptr_t nr_pages)
+{
+	uintptr_t parent_table_addr;
+	uintptr_t child_table_addr;
+	struct mm_page_frame * parent_table;
+	struct mm_page_frame * child_table;
+	uintptr_t * src;
+	uintptr_t * dst;
+	uintptr_t nr_copied = 0;
+	bool empty;
+	int err;
+	
+retry:
+	// rcu_read_lock() keeps both tables from being freed until their locks are taken and pt_unlinked is checked
+	rcu_read_lock();
+	
+	err = get_leaf_page_table(mem, child, vfn, 1, &child_table_addr);
+	if(err)
+	{
+		rcu_read_unlock();
+		return err;
+	}
+	
+	if(get_leaf_page_table(mem, parent, vfn, 0, &parent_table_addr))
+	{
+		// Reclaim emptied and freed the parent's table meanwhile
+		rcu_read_unlock();
+		free_empty_page_tables(mem, child, vfn);
+		return 0;
+	}
+	
+	parent_table = phys_to_pframe(mem, parent_table_addr);
+	child_table = phys_to_pframe(mem, child_table_addr);
+	
+	// The parent address space's table is always locked first, lockdep is told the child's nests inside it
+	spin_lock(&parent_table->ptl);
+	spin_lock_nested(&child_table->ptl, SINGLE_DEPTH_NESTING);
+	
+	if(parent_table->pt_unlinked || child_table->pt_unlinked)
+	{
+		spin_unlock(&child_table->ptl);
+		spin_unlock(&parent_table->ptl);
+		rcu_read_unlock();
+		goto retry;
+	}
+	
+	// Only the child's own walks and this fork touch its tables, and nothing in the child has been mapped yet to empty the table
+	src = get_PTE_address(vfn, 4, parent_table_addr);
+	dst = get_PTE_address(vfn, 4, child_table_addr);
+	
+	for(uintptr_t i = 0; i < nr_pages; i++)
+	{
+		uintptr_t pte = src[i];
+		struct mm_page_frame * p_frame;
+		
+		if( !(pte & PTE_VALID) )
+		{
+			continue;
+		}
+		
+		// Eviction freezes the refcount and clears the entry under this lock, so a valid entry holds a reference
+		p_frame = phys_to_pframe(mem, (pte & PTE_PFN_MASK) << 12);
+		atomic_inc(&p_frame->pf_refcount);
+		atomic_inc(&p_frame->pf_mapcount);
+		
+		set_bit(PTE_READ_ONLY_BIT, (unsigned long *)&src[i]);
+		
+		if( !(dst[i] & PTE_VALID) )
+		{
+			child_table->pt_nr_used++;
+		}
+		WRITE_ONCE(dst[i], (pte | PTE_READ_ONLY) & ~PTE_REFERENCE);
+		nr_copied++;
+	}
+	
+	empty = !child_table->pt_nr_used;
+	
+	spin_unlock(&child_table->ptl);
+	spin_unlock(&parent_table->ptl);
+	rcu_read_unlock();
+	
+	atomic_long_add(nr_copied, &child->nr_mapped_pages);
+	
+	if(empty)
+	{
+		// Every page of the stretch is swapped out or not touched yet
+		free_empty_page_tables(mem, child, vfn);
+	}
+	
+	return 0;
+}
+
+
+/*
+This function shares the pages of the nr_pages pages from vfn of the parent with the child, one level 4 page table of the parent at a time
+*/
+
+static int copy_range(struct mm_physical_memory * mem, struct mm_address_space * parent, struct mm_address_space * child, uintptr_t vfn, uintptr_t nr_pages)
+{
+	uintptr_t done = 0;
+	int err = 0;
+	
+	while(done < nr_pages && !err)
+	{
+		uintptr_t run = min(nr_pages - done, 512 - ((vfn + done) & 0x01FF));
+		uintptr_t pte;
+		
+		rcu_read_lock();
+		pte = read_level3_entry(parent, vfn + done);
+		rcu_read_unlock();
+		
+		if(pte & PTE_VALID)
+		{
+			// A huge page fills its aligned 512 page stretch, so it is copied once
+			err = (pte & PTE_HUGE) ? copy_huge_page(mem, child, (vfn + done) & ~0x01FFUL, pte) : copy_pte_range(mem, parent, child, vfn + done, run);
+		}
+		done += run;
+	}
+	
+	return err;
+}
+
+
+/*
+This function undoes a fork that failed part way, the pages shared with the child so far are unmapped, its copies of huge pages
+and of swapped out pages are freed and the child's address space is removed
+*/
+
+static void unwind_fork(struct mm_physical_memory * mem, struct mm_address_space * child)
+{
+	struct mm_vma *vma, *temp_vma;
+	
+	// No one but the failed fork ever used the child, so its VMAs do not change under the walk
+	list_for_each_entry_safe(vma, temp_vma, &child->vma_list, vm_link)
+	{
+		uintptr_t vfn = vma->vm_start >> 12;
+		uintptr_t nr_pages = (vma->vm_end - vma->vm_start) >> 12;
+		
+		// mm_unmap_range_as() leaves huge pages alone, the copies are freed the way mm_free_page() does it
+		for(uintptr_t table_vfn = vfn & ~0x01FFUL; table_vfn < vfn + nr_pages; table_vfn += 512)
+		{
+			struct mm_page_frame * p_frame;
+			uintptr_t pte;
+			
+			rcu_read_lock();
+			pte = read_level3_entry(child, table_vfn);
+			rcu_read_unlock();
+			
+			if( !(pte & PTE_VALID) || !(pte & PTE_HUGE) || invalidate_PTE(mem, child, table_vfn << 12) )
+			{
+				continue;
+			}
+			
+			p_frame = phys_to_pframe(mem, (pte & PTE_PFN_MASK) << 12);
+			atomic_long_sub(1L << HUGE_PAGE_ORDER, &child->nr_mapped_pages);
+			atomic_dec(&p_frame->pf_mapcount);
+			if(atomic_dec_and_test(&p_frame->pf_refcount))
+			{
+				free_page_internal(mem, p_frame->physical_start_address, 0);
+			}
+		}
+		
+		// Also drops the child's copies in swap space and the page tables left empty
+		if(mm_unmap_range_as(mem, child, vma->vm_start, nr_pages))
+		{
+			printk(KERN_ERR "mm_management : Could not unmap addr:%lx of pid:%d while unwinding the fork\n", vma->vm_start, child->pid);
+		}
+	}
+	
+	mm_remove_address_space(mem, child);
+}
+
+
+/*
+This function forks the address space of the calling pid into a new address space for child_pid
+Mapped pages are shared copy-on-write, so fork copies page tables rather than pages
+A fork that fails part way is undone with unwind_fork(), child_pid is left without an address space
+*/
+
+int mm_fork(struct mm_physical_memory * mem, pid_t child_pid)
+{
+	struct mm_address_space * parent = mm_find_address_space(mem, current->pid);
+	struct mm_address_space * child;
+	struct mm_vma * vma;
+	int err;
+	
+	if(!parent || child_pid == current->pid || mm_find_address_space(mem, child_pid))
+	{
+		printk(KERN_ERR "mm_management : Invalid fork of pid:%d into pid:%d\n", current->pid, child_pid);
+		return -INVALID_INPUT;
+	}
+	
+	child = mm_get_address_space(mem, child_pid);
+	if(!child)
+	{
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	err = mm_vma_dup(child, parent);
+	
+	// Only current changes its own VMAs
+	list_for_each_entry(vma, &parent->vma_list, vm_link)
+	{
+		uintptr_t nr_pages = (vma->vm_end - vma->vm_start) >> 12;
+		
+		if(err)
+		{
+			break;
+		}
+		
+		err = copy_range(mem, parent, child, vma->vm_start >> 12, nr_pages);
+		if(!err)
+		{
+			err = swap_dup_range(parent->pid, child_pid, vma->vm_start, nr_pages);
+		}
+	}
+	
+	// Cached translations of the parent still allow writes to the pages that are shared now
+	mm_tlb_flush_range(mem->tlb, parent->pid, 0, MM_VMA_END >> 12);
+	
+	if(err)
+	{
+		printk(KERN_ERR "mm_management : Fork of pid:%d into pid:%d failed, err:%d\n", current->pid, child_pid, err);
+		unwind_fork(mem, child);
+	}
+	
+	return err;
+}
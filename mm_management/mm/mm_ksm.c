@@ -0,0 +1,415 @@
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/jhash.h>
+#include "../include/mm_address_space.h"
+#include "../include/mm_ksm.h"
+
+/*
+Same page merging
+A background thread walks alloc_pages a batch at a time, rotating the frames it checked to the tail, and checksums each order-0 frame that has a single mapping
+A frame whose checksum did not change since the previous pass is merged into a stable frame with the same contents if there is one,
+or else paired with another candidate of the current full scan, which then becomes a stable frame
+Merging write protects the PTE of a frame before comparing it byte for byte and points it at the stable frame with PTE_READ_ONLY set,
+so the first write to a merged page copies it again through do_wp_page()
+Stable frames are freed once every page merged into them was written or unmapped
+*/
+
+struct mm_ksm * ksm = NULL;
+
+
+static u32 ksm_checksum(struct mm_page_frame * p_frame)
+{
+	return jhash2((const u32 *)p_frame->physical_start_address, PAGE_SIZE_EXP / sizeof(u32), 17);
+}
+
+
+/*
+This function finds the PTE of p_frame through its reverse mapping and locks its page table
+The frame must be mapped by that PTE only and hold no reference but the mapping and the scanner's
+Caller must hold rcu_read_lock()
+Returns NULL if the frame is not mapped that way, the page table lock is held otherwise
+*/
+
+static uintptr_t * ksm_lock_pte(struct mm_physical_memory * mem, struct mm_page_frame * p_frame, spinlock_t ** ptl)
+{
+	struct mm_address_space * as = mm_find_address_space(mem, p_frame->pid);
+	uintptr_t vfn = p_frame->virtual_start_address >> 12;
+	uintptr_t page_table_addr;
+	uintptr_t * pte_address;
+	
+	if(!as || get_leaf_page_table(mem, as, vfn, 0, &page_table_addr))
+	{
+		return NULL;
+	}
+	
+	pte_address = get_PTE_address(vfn, 4, page_table_addr);
+	*ptl = pte_lockptr(mem, page_table_addr);
+	
+	spin_lock(*ptl);
+	
+	if( phys_to_pframe(mem, page_table_addr)->pt_unlinked || !(*pte_address & PTE_VALID) ||
+		((*pte_address & PTE_PFN_MASK) << 12) != p_frame->physical_start_address ||
+		atomic_read(&p_frame->pf_mapcount) != 1 || atomic_read(&p_frame->pf_refcount) != 2 )
+	{
+		spin_unlock(*ptl);
+		return NULL;
+	}
+	
+	// Walks only cache a translation after checking the entry under this lock (tlb_insert_walked()), so once the flush is done no writable one is left
+	// A write through an address translated before the flush is not tracked by the simulator
+	set_bit(PTE_READ_ONLY_BIT, (unsigned long *)pte_address);
+	mm_tlb_flush_page(mem->tlb, p_frame->pid, vfn);
+	
+	return pte_address;
+}
+
+
+/*
+This function write protects the only mapping of p_frame before it becomes a stable frame
+Returns -WRONG_VALUE if the frame is not mapped that way any more
+*/
+
+static int ksm_write_protect(struct mm_physical_memory * mem, struct mm_page_frame * p_frame)
+{
+	spinlock_t * ptl;
+	int err = -WRONG_VALUE;
+	
+	rcu_read_lock();
+	
+	if(ksm_lock_pte(mem, p_frame, &ptl))
+	{
+		spin_unlock(ptl);
+		err = 0;
+	}
+	
+	rcu_read_unlock();
+	
+	return err;
+}
+
+
+/*
+This function points the only mapping of p_frame at kframe if both hold the same contents
+kframe must be write protected and held by the caller
+On success the mapping's reference to p_frame is dropped, leaving the caller's to be put
+Returns -WRONG_VALUE if the frame changed or is not mapped that way any more
+*/
+
+static int ksm_merge(struct mm_physical_memory * mem, struct mm_page_frame * kframe, struct mm_page_frame * p_frame)
+{
+	uintptr_t * pte_address;
+	spinlock_t * ptl;
+	int err = -WRONG_VALUE;
+	
+	rcu_read_lock();
+	
+	pte_address = ksm_lock_pte(mem, p_frame, &ptl);
+	if(pte_address)
+	{
+		if(!memcmp((void *)kframe->physical_start_address, (void *)p_frame->physical_start_address, PAGE_SIZE_EXP))
+		{
+			atomic_inc(&kframe->pf_refcount);
+			atomic_inc(&kframe->pf_mapcount);
+			
+			WRITE_ONCE(*pte_address, set_PTE( kframe->physical_start_address >> 12 ) | PTE_READ_ONLY);
+			mm_tlb_flush_page(mem->tlb, p_frame->pid, p_frame->virtual_start_address >> 12);
+			
+			atomic_dec(&p_frame->pf_mapcount);
+			atomic_dec(&p_frame->pf_refcount);
+			err = 0;
+		}
+		
+		// A frame that differs stays write protected, its next write reuses it through do_wp_page()
+		spin_unlock(ptl);
+	}
+	
+	rcu_read_unlock();
+	
+	return err;
+}
+
+
+/*
+This function tries to merge one frame held by a temporary reference into a stable frame or another candidate
+*/
+
+static void ksm_scan_frame(struct mm_physical_memory * mem, struct mm_page_frame * p_frame)
+{
+	struct ksm_stable_node * node;
+	struct ksm_rmap_item * item;
+	u32 checksum = ksm_checksum(p_frame);
+	
+	// A page that is still being written is not worth write protecting
+	if(checksum != p_frame->pf_checksum)
+	{
+		p_frame->pf_checksum = checksum;
+		return;
+	}
+	
+	hash_for_each_possible(ksm->stable_hash, node, s_hash_link, checksum)
+	{
+		if(node->checksum == checksum && !ksm_merge(mem, node->p_frame, p_frame))
+		{
+			ksm->nr_merged++;
+			return;
+		}
+	}
+	
+	hash_for_each_possible(ksm->unstable_hash, item, u_hash_link, checksum)
+	{
+		struct mm_page_frame * kframe = item->p_frame;
+		
+		if(item->checksum != checksum || kframe == p_frame || !atomic_inc_not_zero(&kframe->pf_refcount))
+		{
+			continue;
+		}
+		
+		// The candidate may have been freed and reused since it was seen, ksm_merge() compares the contents again
+		if( !(kframe->pf_flags & PF_ALLOCATED) || kframe->order || ksm_write_protect(mem, kframe) || ksm_merge(mem, kframe, p_frame) )
+		{
+			mm_put_page(mem, kframe);
+			continue;
+		}
+		
+		node = kmalloc( sizeof(struct ksm_stable_node), GFP_KERNEL);
+		if(!node)
+		{
+			// The pair stays merged, the frame is only not found for further merges
+			printk(KERN_ERR "mm_management : Error allocating struct ksm_stable_node\n");
+			mm_put_page(mem, kframe);
+			ksm->nr_merged++;
+			return;
+		}
+		
+		// The reference taken above is kept by the node
+		node->checksum = checksum;
+		node->p_frame = kframe;
+		hash_add(ksm->stable_hash, &node->s_hash_link, checksum);
+		
+		hash_del(&item->u_hash_link);
+		kfree(item);
+		ksm->nr_merged++;
+		return;
+	}
+	
+	item = kmalloc( sizeof(struct ksm_rmap_item), GFP_KERNEL);
+	if(item)
+	{
+		item->checksum = checksum;
+		item->p_frame = p_frame;
+		hash_add(ksm->unstable_hash, &item->u_hash_link, checksum);
+	}
+}
+
+
+static void ksm_clear_unstable(void)
+{
+	struct ksm_rmap_item * item;
+	struct hlist_node * temp;
+	int bkt;
+	
+	hash_for_each_safe(ksm->unstable_hash, bkt, temp, item, u_hash_link)
+	{
+		hash_del(&item->u_hash_link);
+		kfree(item);
+	}
+}
+
+
+/*
+This function frees the stable frames no page maps any more and recounts the sharing
+*/
+
+static void ksm_prune_stable(struct mm_physical_memory * mem)
+{
+	struct ksm_stable_node * node;
+	struct hlist_node * temp;
+	uintptr_t nr_shared = 0;
+	uintptr_t nr_sharing = 0;
+	int bkt;
+	
+	hash_for_each_safe(ksm->stable_hash, bkt, temp, node, s_hash_link)
+	{
+		int mapcount = atomic_read(&node->p_frame->pf_mapcount);
+		
+		if(!mapcount)
+		{
+			hash_del(&node->s_hash_link);
+			mm_put_page(mem, node->p_frame);
+			kfree(node);
+			continue;
+		}
+		
+		nr_shared++;
+		nr_sharing += mapcount - 1;
+	}
+	
+	WRITE_ONCE(ksm->nr_pages_shared, nr_shared);
+	WRITE_ONCE(ksm->nr_pages_sharing, nr_sharing);
+}
+
+
+/*
+This function checks the next pages_to_scan frames of alloc_pages
+*/
+
+static void ksm_do_scan(struct mm_physical_memory * mem)
+{
+	struct mm_page_frame * p_frame;
+	unsigned int nr_batch = 0;
+	
+	spin_lock(&mem->alloc_lists_lock);
+	
+	// A full scan covers the frames allocated when it starts
+	if(!ksm->scan_remaining)
+	{
+		ksm->scan_remaining = mem->nr_alloc_pages;
+	}
+	
+	while(nr_batch < ksm->pages_to_scan && ksm->scan_remaining && !list_empty(&mem->alloc_pages))
+	{
+		p_frame = list_first_entry(&mem->alloc_pages, struct mm_page_frame, pf_link);
+		list_move_tail(&p_frame->pf_link, &mem->alloc_pages);
+		ksm->scan_remaining--;
+		
+		if(!p_frame->order)
+		{
+			ksm->batch[nr_batch++] = p_frame;
+		}
+	}
+	
+	spin_unlock(&mem->alloc_lists_lock);
+	
+	// A reference is only taken while a frame is checked, so that a candidate of the same batch can still be merged with it
+	for(unsigned int i = 0; i < nr_batch; i++)
+	{
+		p_frame = ksm->batch[i];
+		
+		if(!atomic_inc_not_zero(&p_frame->pf_refcount))
+		{
+			continue;
+		}
+		
+		// Frames shared copy-on-write or already stable carry more references
+		if( (p_frame->pf_flags & PF_ALLOCATED) && !p_frame->order && atomic_read(&p_frame->pf_mapcount) == 1 && atomic_read(&p_frame->pf_refcount) == 2 )
+		{
+			ksm_scan_frame(mem, p_frame);
+		}
+		mm_put_page(mem, p_frame);
+	}
+	
+	ksm->nr_pages_scanned += nr_batch;
+	
+	if(!ksm->scan_remaining)
+	{
+		ksm_clear_unstable();
+		ksm->nr_full_scans++;
+	}
+	
+	ksm_prune_stable(mem);
+}
+
+
+static int mm_ksmd(void * data)
+{
+	while(!kthread_should_stop())
+	{
+		ksm_do_scan(ksm->mem);
+		schedule_timeout_interruptible(msecs_to_jiffies(ksm->sleep_ms));
+	}
+	
+	return 0;
+}
+
+
+/*
+This function starts the same page merging scanner
+*/
+
+int mm_ksm_init(struct mm_physical_memory * mem, unsigned int pages_to_scan, unsigned int sleep_ms)
+{
+	if(!pages_to_scan)
+	{
+		printk(KERN_ERR "mm_management : Invalid number of pages to scan given to mm_ksm_init()\n");
+		return -INVALID_INPUT;
+	}
+	
+	ksm = kzalloc( sizeof(struct mm_ksm), GFP_KERNEL);
+	if(!ksm)
+	{
+		printk(KERN_ERR "mm_management : Error allocating struct mm_ksm\n");
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	ksm->batch = kmalloc_array(pages_to_scan, sizeof(struct mm_page_frame *), GFP_KERNEL);
+	if(!ksm->batch)
+	{
+		printk(KERN_ERR "mm_management : Error allocating the KSM scan batch\n");
+		mm_ksm_uninit();
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	ksm->mem = mem;
+	ksm->pages_to_scan = pages_to_scan;
+	ksm->sleep_ms = sleep_ms;
+	hash_init(ksm->stable_hash);
+	hash_init(ksm->unstable_hash);
+	
+	ksm->ksmd = kthread_run(mm_ksmd, NULL, "mm_ksmd");
+	if(IS_ERR(ksm->ksmd))
+	{
+		printk(KERN_ERR "mm_management : Error starting ksmd\n");
+		ksm->ksmd = NULL;
+		mm_ksm_uninit();
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	return 0;
+}
+
+
+/*
+This function stops the scanner and drops its references to the stable frames, frames still mapped stay allocated
+*/
+
+void mm_ksm_uninit(void)
+{
+	struct ksm_stable_node * node;
+	struct hlist_node * temp;
+	int bkt;
+	
+	if(!ksm)
+	{
+		return;
+	}
+	
+	if(ksm->ksmd)
+	{
+		kthread_stop(ksm->ksmd);
+	}
+	
+	ksm_clear_unstable();
+	
+	hash_for_each_safe(ksm->stable_hash, bkt, temp, node, s_hash_link)
+	{
+		hash_del(&node->s_hash_link);
+		mm_put_page(ksm->mem, node->p_frame);
+		kfree(node);
+	}
+	
+	kfree(ksm->batch);
+	kfree(ksm);
+	ksm = NULL;
+}
+
+
+void mm_ksm_print_stats(void)
+{
+	if(!ksm)
+	{
+		return;
+	}
+	
+	printk("mm_management : KSM : pages shared:%lu, pages sharing:%lu, merged:%lu\n", READ_ONCE(ksm->nr_pages_shared), READ_ONCE(ksm->nr_pages_sharing), READ_ONCE(ksm->nr_merged));
+	printk("mm_management : KSM : pages scanned:%lu, full scans:%lu\n", READ_ONCE(ksm->nr_pages_scanned), READ_ONCE(ksm->nr_full_scans));
+}
@@ -0,0 +1,96 @@
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include "../include/mm_swap_space.h"
+#include "../include/mm_kswapd.h"
+
+/*
+Background reclaim
+Allocations that leave fewer than wmark_low frames in the buddy allocator wake kswapd, which swaps pages out until wmark_high frames are free
+Allocators only reclaim themselves once taking a block would leave fewer than wmark_min frames free
+Frames on the per-cpu lists are not counted as free, as with the buddy allocator's own nr_free_pages
+*/
+
+
+static int mm_kswapd(void * data)
+{
+	struct mm_physical_memory * mem = (struct mm_physical_memory *)data;
+	
+	while(!kthread_should_stop())
+	{
+		wait_event_interruptible(mem->kswapd_wait, READ_ONCE(mem->kswapd_pending) || kthread_should_stop());
+		WRITE_ONCE(mem->kswapd_pending, false);
+		
+		while(!kthread_should_stop())
+		{
+			uintptr_t nr_free = READ_ONCE(mem->nr_free_pages);
+			int nr_evicted;
+			
+			if(nr_free >= mem->wmark_high)
+			{
+				break;
+			}
+			
+			// Nothing left to evict, sleep until the next wakeup
+			nr_evicted = swap_page(mem, mem->wmark_high - nr_free, false);
+			if(nr_evicted < 0)
+			{
+				break;
+			}
+			mem->nr_kswapd_reclaimed += nr_evicted;
+			cond_resched();
+		}
+	}
+	
+	return 0;
+}
+
+
+/*
+This function sets the watermarks from the size of memory and starts kswapd
+*/
+
+int mm_kswapd_init(struct mm_physical_memory * mem)
+{
+	mem->wmark_min = max_t(uintptr_t, mem->total_pages / MM_WMARK_MIN_RATIO, 1);
+	mem->wmark_low = mem->wmark_min + max_t(uintptr_t, mem->wmark_min / 4, 1);
+	mem->wmark_high = mem->wmark_min + max_t(uintptr_t, mem->wmark_min / 2, 2);
+	
+	mem->kswapd = kthread_run(mm_kswapd, mem, "mm_kswapd");
+	if(IS_ERR(mem->kswapd))
+	{
+		printk(KERN_ERR "mm_management : Error starting kswapd\n");
+		mem->kswapd = NULL;
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	return 0;
+}
+
+
+void mm_kswapd_uninit(struct mm_physical_memory * mem)
+{
+	if(mem->kswapd)
+	{
+		kthread_stop(mem->kswapd);
+		mem->kswapd = NULL;
+	}
+}
+
+
+void mm_kswapd_wakeup(struct mm_physical_memory * mem)
+{
+	if(READ_ONCE(mem->kswapd_pending))
+	{
+		return;
+	}
+	
+	WRITE_ONCE(mem->kswapd_pending, true);
+	wake_up_interruptible(&mem->kswapd_wait);
+}
+
+
+void mm_kswapd_print_stats(struct mm_physical_memory * mem)
+{
+	printk("mm_management : KSWAPD : wmark min:%lu, low:%lu, high:%lu, free:%lu\n", mem->wmark_min, mem->wmark_low, mem->wmark_high, READ_ONCE(mem->nr_free_pages));
+	printk("mm_management : KSWAPD : kswapd reclaimed:%lu, direct reclaimed:%ld\n", mem->nr_kswapd_reclaimed, atomic_long_read(&mem->nr_direct_reclaimed));
+}
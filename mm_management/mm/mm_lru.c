@@ -0,0 +1,288 @@
+#include "../include/mm_lru.h"
+#include "../include/mm_address_space.h"
+
+/*
+Two list LRU with second chance aging
+New frames start at the head of in_active_pages, a frame whose PTE reference bit is found set is moved to (or kept on) active_pages,
+an active frame found unreferenced is moved back to in_active_pages and reclaim evicts from the tail of in_active_pages
+All lists and counters are protected by lru_lock, reference bits are tested and cleared atomically without the page table lock
+*/
+
+
+/*
+This function puts a newly allocated order-0 frame at the head of the inactive list
+*/
+
+void lru_add_locked(struct mm_physical_memory * mem, struct mm_page_frame * p_frame)
+{
+	p_frame->pf_flags = p_frame->pf_flags & ~PF_ACTIVE;
+	list_add(&p_frame->pf_scheduler_link, &mem->in_active_pages);
+	mem->nr_in_active_pages++;
+}
+
+
+void lru_del_locked(struct mm_physical_memory * mem, struct mm_page_frame * p_frame)
+{
+	if(list_empty(&p_frame->pf_scheduler_link))
+	{
+		return;
+	}
+	
+	list_del_init(&p_frame->pf_scheduler_link);
+	
+	if(p_frame->pf_flags & PF_ACTIVE)
+	{
+		mem->nr_active_pages--;
+		p_frame->pf_flags = p_frame->pf_flags & ~PF_ACTIVE;
+	}
+	else
+	{
+		mem->nr_in_active_pages--;
+	}
+}
+
+
+static void activate_locked(struct mm_physical_memory * mem, struct mm_page_frame * p_frame)
+{
+	list_move(&p_frame->pf_scheduler_link, &mem->active_pages);
+	if( !(p_frame->pf_flags & PF_ACTIVE) )
+	{
+		p_frame->pf_flags = p_frame->pf_flags | PF_ACTIVE;
+		mem->nr_in_active_pages--;
+		mem->nr_active_pages++;
+	}
+}
+
+
+static void deactivate_locked(struct mm_physical_memory * mem, struct mm_page_frame * p_frame)
+{
+	list_move(&p_frame->pf_scheduler_link, &mem->in_active_pages);
+	if(p_frame->pf_flags & PF_ACTIVE)
+	{
+		p_frame->pf_flags = p_frame->pf_flags & ~PF_ACTIVE;
+		mem->nr_active_pages--;
+		mem->nr_in_active_pages++;
+	}
+}
+
+
+/*
+This function checks and clears the reference bit of the PTE that maps p_frame (found through its reverse mapping)
+The TLB entry is shot down as well so the next access walks the page tables and sets the bit again
+Returns true if the frame was referenced since the last check
+*/
+
+static bool test_and_clear_referenced(struct mm_physical_memory * mem, struct mm_page_frame * p_frame)
+{
+	struct mm_address_space * as;
+	uintptr_t vfn = p_frame->virtual_start_address >> 12;
+	uintptr_t page_table_addr;
+	uintptr_t * pte_address;
+	uintptr_t pte;
+	bool referenced = false;
+	
+	// The page tables are walked without their locks, rcu_read_lock() keeps them from being freed under the walk
+	rcu_read_lock();
+	
+	as = mm_find_address_space(mem, p_frame->pid);
+	if(!as || get_leaf_page_table(mem, as, vfn, 0, &page_table_addr))
+	{
+		goto out;
+	}
+	
+	pte_address = get_PTE_address(vfn, 4, page_table_addr);
+	pte = READ_ONCE(*pte_address);
+	
+	if( !(pte & PTE_VALID) || ((pte & PTE_PFN_MASK) << 12) != p_frame->physical_start_address )
+	{
+		goto out;
+	}
+	
+	referenced = test_and_clear_bit(PTE_REFERENCE_BIT, (unsigned long *)pte_address);
+	
+out:
+	rcu_read_unlock();
+	
+	if(referenced)
+	{
+		mm_tlb_flush_page(mem->tlb, p_frame->pid, vfn);
+	}
+	
+	return referenced;
+}
+
+
+/*
+This function moves unreferenced frames from the tail of the active list to the inactive list until the inactive list is at least as long as the active list
+Referenced frames get their second chance at the head of the active list
+*/
+
+static void shrink_active_list_locked(struct mm_physical_memory * mem, uintptr_t nr_to_scan)
+{
+	struct mm_page_frame * p_frame;
+	
+	while(nr_to_scan-- && mem->nr_in_active_pages < mem->nr_active_pages)
+	{
+		p_frame = list_last_entry(&mem->active_pages, struct mm_page_frame, pf_scheduler_link);
+		
+		if(test_and_clear_referenced(mem, p_frame))
+		{
+			list_move(&p_frame->pf_scheduler_link, &mem->active_pages);
+		}
+		else
+		{
+			deactivate_locked(mem, p_frame);
+		}
+	}
+}
+
+
+/*
+This function is one aging pass over both lists
+Referenced frames near the tail of the inactive list are promoted to the active list, then the active list is shrunk back towards the size of the inactive list
+*/
+
+void mm_lru_age(struct mm_physical_memory * mem, uintptr_t nr_to_scan)
+{
+	struct mm_page_frame *p_frame, *temp_p_frame;
+	uintptr_t scanned = 0;
+	
+	spin_lock(&mem->lru_lock);
+	
+	list_for_each_entry_safe_reverse(p_frame, temp_p_frame, &mem->in_active_pages, pf_scheduler_link)
+	{
+		if(scanned++ == nr_to_scan)
+		{
+			break;
+		}
+		
+		if(test_and_clear_referenced(mem, p_frame))
+		{
+			activate_locked(mem, p_frame);
+		}
+	}
+	
+	shrink_active_list_locked(mem, nr_to_scan);
+	
+	spin_unlock(&mem->lru_lock);
+}
+
+
+/*
+This function picks the frame to evict and isolates it, taking it off the LRU and allocated lists and clearing PF_ALLOCATED
+Frames at the tail of the inactive list that were referenced are activated instead (second chance), as are frames shared copy-on-write
+and stable frames of the KSM scanner, which hold a reference of their own
+If every frame was referenced the coldest one is taken anyway
+Caller must hold alloc_lists_lock and lru_lock
+Returns NULL if there is no allocated order-0 frame
+*/
+
+static struct mm_page_frame * isolate_victim_locked(struct mm_physical_memory * mem)
+{
+	struct mm_page_frame * p_frame = NULL;
+	uintptr_t nr_to_scan = mem->nr_active_pages + mem->nr_in_active_pages;
+	
+	while(nr_to_scan--)
+	{
+		if(list_empty(&mem->in_active_pages))
+		{
+			shrink_active_list_locked(mem, mem->nr_active_pages);
+			
+			// Every active frame was referenced, fall back to the coldest one
+			if(list_empty(&mem->in_active_pages))
+			{
+				break;
+			}
+		}
+		
+		p_frame = list_last_entry(&mem->in_active_pages, struct mm_page_frame, pf_scheduler_link);
+		
+		if( atomic_read(&p_frame->pf_mapcount) <= 1 && atomic_read(&p_frame->pf_refcount) <= 1 && !test_and_clear_referenced(mem, p_frame) )
+		{
+			break;
+		}
+		
+		activate_locked(mem, p_frame);
+		p_frame = NULL;
+	}
+	
+	if(!p_frame)
+	{
+		if(!list_empty(&mem->in_active_pages))
+		{
+			p_frame = list_last_entry(&mem->in_active_pages, struct mm_page_frame, pf_scheduler_link);
+		}
+		else if(!list_empty(&mem->active_pages))
+		{
+			p_frame = list_last_entry(&mem->active_pages, struct mm_page_frame, pf_scheduler_link);
+		}
+	}
+	
+	if(p_frame)
+	{
+		lru_del_locked(mem, p_frame);
+		list_del_init(&p_frame->pf_link);
+		mem->nr_alloc_pages--;
+		p_frame->pf_flags = p_frame->pf_flags & ~PF_ALLOCATED;
+	}
+	
+	return p_frame;
+}
+
+
+/*
+This function isolates up to nr_frames victims with a single acquisition of alloc_lists_lock and lru_lock, see isolate_victim_locked()
+The victims are returned in p_frames
+Returns the number of frames isolated
+*/
+
+uintptr_t mm_lru_isolate_victims(struct mm_physical_memory * mem, struct mm_page_frame ** p_frames, uintptr_t nr_frames)
+{
+	uintptr_t count = 0;
+	
+	spin_lock(&mem->alloc_lists_lock);
+	spin_lock(&mem->lru_lock);
+	
+	while(count < nr_frames && (p_frames[count] = isolate_victim_locked(mem)))
+	{
+		count++;
+	}
+	
+	spin_unlock(&mem->lru_lock);
+	spin_unlock(&mem->alloc_lists_lock);
+	
+	return count;
+}
+
+
+static void lru_aging_work_fn(struct work_struct * work)
+{
+	struct mm_physical_memory * mem = container_of(to_delayed_work(work), struct mm_physical_memory, lru_aging_work);
+	
+	mm_lru_age(mem, MM_LRU_AGING_BATCH);
+	
+	schedule_delayed_work(&mem->lru_aging_work, msecs_to_jiffies(MM_LRU_AGING_INTERVAL_MS));
+}
+
+
+/*
+This function starts the periodic aging pass
+*/
+
+void mm_lru_init(struct mm_physical_memory * mem)
+{
+	INIT_DELAYED_WORK(&mem->lru_aging_work, lru_aging_work_fn);
+	schedule_delayed_work(&mem->lru_aging_work, msecs_to_jiffies(MM_LRU_AGING_INTERVAL_MS));
+}
+
+
+void mm_lru_uninit(struct mm_physical_memory * mem)
+{
+	cancel_delayed_work_sync(&mem->lru_aging_work);
+}
+
+
+void mm_lru_print_stats(struct mm_physical_memory * mem)
+{
+	printk("mm_management : LRU : active:%lu, inactive:%lu\n", mem->nr_active_pages, mem->nr_in_active_pages);
+}
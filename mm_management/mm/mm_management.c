@@ -1,3 +1,4 @@
+#include <linux/vmalloc.h>
 #include "../include/mm_management.h"
 
 /*
@@ -8,10 +9,13 @@ void print_list(void)
 	
 	printk("mm_management : ----------------------------\n");
 	printk("mm_management : Free pages----\n");
-	list_for_each(pos, &mem->free_pages)
+	for(int order = 0; order <= MM_MAX_ORDER; order++)
 	{
-		p_frame = list_entry(pos, struct mm_page_frame, pf_link);
-		printk("mm_management : phy addr:%lx\n", p_frame->physical_start_address);
+		list_for_each(pos, &mem->free_area[order].free_list)
+		{
+			p_frame = list_entry(pos, struct mm_page_frame, pf_link);
+			printk("mm_management : phy addr:%lx, order:%d\n", p_frame->physical_start_address, order);
+		}
 	}
 	
 	printk("mm_management : Allocated pages----\n");
@@ -33,84 +37,111 @@ void print_list(void)
 
 /*
 This function gets the requested memory from the Linux kernel which will be acts as the primary memory in the simulator and it divides the primary memory into page frames
+memory_size is rounded down to whole pages, the memory comes from vmalloc() so that it is not limited by the largest kmalloc() size
+page_size must be PAGE_SIZE_EXP, since PTEs and virtual frame numbers assume a 12 bit page offset
 */
 
-int initialize_memory(struct mm_physical_memory * mem)
+int initialize_memory(struct mm_physical_memory ** mem_ptr, uintptr_t memory_size, unsigned int page_size)
 {
-	mem = kmalloc( sizeof(struct mm_physical_memory), GFP_KERNEL);
+	if(page_size != PAGE_SIZE_EXP)
+	{
+		printk(KERN_ERR "mm_management : Unsupported page size %u, the page tables only support %u byte pages\n", page_size, PAGE_SIZE_EXP);
+		return -INVALID_INPUT;
+	}
+	
+	if(memory_size < PAGE_SIZE_EXP)
+	{
+		printk(KERN_ERR "mm_management : Invalid memory size %lu, at least one page is needed\n", memory_size);
+		return -INVALID_INPUT;
+	}
+	
+	struct mm_physical_memory * mem = kmalloc( sizeof(struct mm_physical_memory), GFP_KERNEL);
 	if(!mem)
 	{
 		printk(KERN_ERR "mm_management : Error allocating struct mm_physical_memory\n");
 		return -ERROR_ALLOCATING_MEMORY;
 	}
 	
-	mem->memory_addr_start = (uintptr_t)kmalloc( TOTAL_MEMORY_EXP, GFP_KERNEL);
+	mem->total_pages = memory_size / PAGE_SIZE_EXP;
+	mem->memory_addr_start = (uintptr_t)vmalloc(mem->total_pages * PAGE_SIZE_EXP);
 	if(!mem->memory_addr_start)
 	{
-		printk(KERN_ERR "mm_management : Error allocating requested memory\n");
+		printk(KERN_ERR "mm_management : Error allocating requested memory of %lu pages\n", mem->total_pages);
+		kfree(mem);
 		return -ERROR_ALLOCATING_MEMORY;
 	}
-	mem->total_pages = TOTAL_MEMORY_EXP / PAGE_SIZE_EXP;
-	
-	INIT_LIST_HEAD(&mem->free_pages);
-	INIT_LIST_HEAD(&mem->alloc_pages);
-	INIT_LIST_HEAD(&mem->pinned_pages);
-	
-	mutex_init(&mem->mm_memory_mutex);
-	
-	return 0;	
-}
-
-/*
-Frees the memory that was given by the Linux
-*/
-
-/*int uninitialize_memory(void)
-{
-	struct mm_page_frame * p_frame, * temp_p_frame;
 	
-	list_for_each_entry_safe(p_frame, temp_p_frame, &mem->free_pages, pf_link)
-	{
-		list_del(&p_frame->pf_link);
-		kfree(p_frame);
-	}
+	printk("mm_management : Simulated memory of %lu pages, %lu KiB\n", mem->total_pages, (mem->total_pages * PAGE_SIZE_EXP) >> 10);
 	
-	if(!list_empty(&mem->free_pages))
+	for(int order = 0; order <= MM_MAX_ORDER; order++)
 	{
-		printk(KERN_ERR "mm_management : All pages are not free'd. Free pages are present in kernel\n");
-		return -ERROR_DEALLOCATING_MEMORY;
+		INIT_LIST_HEAD(&mem->free_area[order].free_list);
+		mem->free_area[order].nr_free = 0;
 	}
+	mem->nr_free_pages = 0;
+	spin_lock_init(&mem->free_area_lock);
 	
-	list_for_each_entry_safe(p_frame, temp_p_frame, &mem->alloc_pages, pf_link)
+	mem->pframes = NULL;
+	mem->pcp = alloc_percpu(struct mm_per_cpu_pages);
+	if(!mem->pcp)
 	{
-		list_del(&p_frame->pf_link);
-		kfree(p_frame);
+		printk(KERN_ERR "mm_management : Error allocating per-cpu page frame lists\n");
+		vfree((void *)mem->memory_addr_start);
+		kfree(mem);
+		return -ERROR_ALLOCATING_MEMORY;
 	}
 	
-	if(!list_empty(&mem->alloc_pages))
+	int cpu;
+	for_each_possible_cpu(cpu)
 	{
-		printk(KERN_ERR "mm_management : All pages are not free'd. Allocated pages are present in kernel\n");
-		return -ERROR_DEALLOCATING_MEMORY;
+		struct mm_per_cpu_pages * pcp = per_cpu_ptr(mem->pcp, cpu);
+		
+		spin_lock_init(&pcp->lock);
+		INIT_LIST_HEAD(&pcp->frames);
+		pcp->count = 0;
 	}
 	
-	list_for_each_entry_safe(p_frame, temp_p_frame, &mem->pinned_pages, pf_link)
-	{
-		list_del(&p_frame->pf_link);
-		kfree(p_frame);
-	}
+	spin_lock_init(&mem->address_spaces_lock);
+	hash_init(mem->address_spaces);
 	
-	if(!list_empty(&mem->pinned_pages))
-	{
-		printk(KERN_ERR "mm_management : All pages are not free'd. Pinned pages are present in kernel\n");
-		return -ERROR_DEALLOCATING_MEMORY;
-	}
+	mem->tlb = NULL;
+	mem->pwc = NULL;
 	
-	mutex_destroy(&mem->mm_memory_mutex);
+	spin_lock_init(&mem->alloc_lists_lock);
+	INIT_LIST_HEAD(&mem->alloc_pages);
+	mem->nr_alloc_pages = 0;
+	INIT_LIST_HEAD(&mem->pinned_pages);
 	
-	kfree((void *)mem->memory_addr_start);
+	spin_lock_init(&mem->lru_lock);
+	INIT_LIST_HEAD(&mem->active_pages);
+	INIT_LIST_HEAD(&mem->in_active_pages);
+	mem->nr_active_pages = 0;
+	mem->nr_in_active_pages = 0;
+	
+	mem->wmark_min = 0;
+	mem->wmark_low = 0;
+	mem->wmark_high = 0;
+	mem->kswapd = NULL;
+	init_waitqueue_head(&mem->kswapd_wait);
+	mem->kswapd_pending = false;
+	mem->nr_kswapd_reclaimed = 0;
+	atomic_long_set(&mem->nr_direct_reclaimed, 0);
+	
+	*mem_ptr = mem;
+	return 0;	
+}
+
+/*
+Frees the memory that was given by the Linux
+Every other part of the simulator must be uninitialised before, the frames of the simulated memory are not looked at
+*/
+
+void uninitialize_memory(struct mm_physical_memory * mem)
+{
+	free_percpu(mem->pcp);
+	kvfree(mem->pframes);
+	vfree((void *)mem->memory_addr_start);
 	kfree(mem);
-	
-	return 0;
-}*/
+}
 
 
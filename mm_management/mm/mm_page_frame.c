@@ -1,471 +1,2139 @@
-#include "../include/mm_page_frame.h"
+#include "../include/mm_swap_space.h"
+#include "../include/mm_lru.h"
+#include "../include/mm_kswapd.h"
+#include "../include/mm_vma.h"
 
-int handle_page_fault(int cmd, void * data);
-
-uintptr_t latest_virtual_address = 0x0000000000000000;
+static void page_table_free_work_fn(struct work_struct * work);
+static int walk_level_lockless(struct mm_physical_memory * mem, uintptr_t vfn, uintptr_t level, uintptr_t page_table_addr, bool write, uintptr_t * next_page_addr);
 
 int initialize_pframes(struct mm_physical_memory * mem)
 {
-	struct mm_page_frame * p_frame;
+	mem->pframes = kvcalloc(mem->total_pages, sizeof(struct mm_page_frame), GFP_KERNEL);
+	if(!mem->pframes)
+	{
+		printk(KERN_ERR "mm_management : Error allocating page frame descriptor array\n");
+		return -ERROR_ALLOCATING_MEMORY;
+	}
 	
-	for(int i=0; i < mem->total_pages-1; i++)
+	for(uintptr_t i = 0; i < mem->total_pages; i++)
 	{
-		p_frame = pframe_init(i, mem);
-		if(!p_frame)
-		{
-			return -ERROR_ALLOCATING_MEMORY;
-		}
-		list_add_tail(&p_frame->pf_link, &mem->free_pages);
+		pframe_init(i, mem);
 	}
 	
-	p_frame = pframe_init(mem->total_pages-1, mem);
-	if(!p_frame)
+	// Hand every frame to the buddy allocator as the largest naturally aligned blocks that fit
+	// Root page tables are allocated per address space, see mm_get_address_space()
+	uintptr_t i = 0;
+	while(i < mem->total_pages)
 	{
-		return -ERROR_ALLOCATING_MEMORY;
+		unsigned int order = MM_MAX_ORDER;
+		
+		while( (i & ((1UL << order) - 1)) || (i + (1UL << order) > mem->total_pages) )
+		{
+			order--;
+		}
+		
+		buddy_free_locked(mem, &mem->pframes[i], order);
+		i += (1UL << order);
 	}
-	list_add_tail(&p_frame->pf_link, &mem->pinned_pages);
 	
-	mem->cr3_page_table_addr = p_frame->physical_start_address;
+	spin_lock_init(&mem->pt_free_lock);
+	INIT_LIST_HEAD(&mem->pt_free_pending);
+	INIT_LIST_HEAD(&mem->pt_free_waiting);
+	mem->pt_free_queued = false;
+	INIT_RCU_WORK(&mem->pt_free_work, page_table_free_work_fn);
+	
 	return 0;
 }
 
 
 /*
-This function initializes struct mm_page_frame
+This function initializes the struct mm_page_frame of the i'th page frame in mem->pframes
 Parameters : 
 i : the index of page frame in the entire memory.
 Returns : pointer of type struct mm_page_frame with initialized values of mm_page_frame
 */
 
-struct mm_page_frame * pframe_init(int i, struct mm_physical_memory * mem)
+struct mm_page_frame * pframe_init(uintptr_t i, struct mm_physical_memory * mem)
 {
-	struct mm_page_frame * p_frame;
+	struct mm_page_frame * p_frame = &mem->pframes[i];
 	
-	p_frame = kmalloc(sizeof(struct mm_page_frame), GFP_KERNEL);
-	if(!p_frame)
-	{
-		printk(KERN_ERR "mm_management : Error allocating struct mm_page_frame\n");
-		return NULL;
-	}
 	p_frame->physical_start_address = mem->memory_addr_start + i*PAGE_SIZE_EXP;
 	p_frame->size = PAGE_SIZE_EXP;
 	p_frame->pf_flags = 0;
+	INIT_LIST_HEAD(&p_frame->pf_link);
+	INIT_LIST_HEAD(&p_frame->pf_scheduler_link);
+	spin_lock_init(&p_frame->ptl);
 	
 	return p_frame;
 }
 
 
 
+static void add_to_free_area(struct mm_physical_memory * mem, struct mm_page_frame * p_frame, unsigned int order)
+{
+	p_frame->order = order;
+	p_frame->pf_flags = PF_BUDDY;
+	list_add(&p_frame->pf_link, &mem->free_area[order].free_list);
+	mem->free_area[order].nr_free++;
+}
+
+
+static void del_from_free_area(struct mm_physical_memory * mem, struct mm_page_frame * p_frame, unsigned int order)
+{
+	list_del_init(&p_frame->pf_link);
+	p_frame->pf_flags = p_frame->pf_flags & ~PF_BUDDY;
+	mem->free_area[order].nr_free--;
+}
+
+
 /*
-This function moves the page from free page list to allocated list or pinned list based om the pinned_page_flag
-If pinned_page_flag is set then it moved the page from freepage list to pinned list else to allocated list
-It returns the pointer of the pframe that was moved to allocated or pinned list
-If it returns NULL then there is no free page available
+This function takes a block of 2^order frames from the buddy free lists, splitting a larger block if needed
+Caller must hold free_area_lock
+Returns the first frame of the block or NULL if no block of the requested size is free
 */
 
-struct mm_page_frame * get_free_page_internal(struct mm_physical_memory * mem, bool pinned_page_flag)
+static struct mm_page_frame * buddy_alloc_locked(struct mm_physical_memory * mem, unsigned int order)
 {
-	//printk("DEBUG : get_free_page_internal\n");
 	struct mm_page_frame * p_frame;
-	int err;
-	mutex_lock(&mem->mm_memory_mutex);
 	
-	if(list_empty(&mem->free_pages))
+	for(unsigned int current_order = order; current_order <= MM_MAX_ORDER; current_order++)
 	{
-		mutex_unlock(&mem->mm_memory_mutex);
-		err = handle_page_fault(PAGE_FAULT_NO_PAGE, 0);
-		if(err)
+		if(list_empty(&mem->free_area[current_order].free_list))
+		{
+			continue;
+		}
+		
+		p_frame = list_first_entry(&mem->free_area[current_order].free_list, struct mm_page_frame, pf_link);
+		del_from_free_area(mem, p_frame, current_order);
+		
+		// Give the upper half back at each step until the block has the requested size
+		while(current_order > order)
 		{
-			return NULL;
+			current_order--;
+			add_to_free_area(mem, p_frame + (1UL << current_order), current_order);
 		}
+		
+		p_frame->order = order;
+		mem->nr_free_pages -= (1UL << order);
+		return p_frame;
 	}
 	
-	if(pinned_page_flag)
+	return NULL;
+}
+
+
+/*
+This function takes a block from the buddy allocator only if at least wmark_min frames stay free afterwards, unless ignore_wmark is set
+Caller must hold free_area_lock
+*/
+
+static struct mm_page_frame * buddy_alloc_wmark_locked(struct mm_physical_memory * mem, unsigned int order, bool ignore_wmark)
+{
+	if(!ignore_wmark && mem->nr_free_pages < mem->wmark_min + (1UL << order))
 	{
-		p_frame = list_first_entry(&mem->free_pages, struct mm_page_frame, pf_link);
-		list_move_tail(&p_frame->pf_link, &mem->pinned_pages);
-		p_frame->pf_flags = p_frame->pf_flags | PF_PINNED;
-		printk("mm_management : PAGE ALLOCATION : Pinned page frame addr:%lx\n",p_frame->physical_start_address);
+		return NULL;
 	}
-	else
+	
+	return buddy_alloc_locked(mem, order);
+}
+
+
+/*
+This function returns a block of 2^order frames to the buddy free lists and merges it with its free buddies
+Caller must hold free_area_lock and must have taken the first frame off the allocated or pinned list
+*/
+
+void buddy_free_locked(struct mm_physical_memory * mem, struct mm_page_frame * p_frame, unsigned int order)
+{
+	uintptr_t index = pframe_index(mem, p_frame);
+	
+	mem->nr_free_pages += (1UL << order);
+	
+	while(order < MM_MAX_ORDER)
+	{
+		uintptr_t buddy_index = index ^ (1UL << order);
+		struct mm_page_frame * buddy;
+		
+		if(buddy_index >= mem->total_pages)
+		{
+			break;
+		}
+		
+		buddy = &mem->pframes[buddy_index];
+		if( !(buddy->pf_flags & PF_BUDDY) || buddy->order != order )
+		{
+			break;
+		}
+		
+		del_from_free_area(mem, buddy, order);
+		index = index & buddy_index;
+		order++;
+	}
+	
+	add_to_free_area(mem, &mem->pframes[index], order);
+}
+
+
+/*
+This function takes an order-0 frame from the current cpu's list, refilling the list with MM_PCP_BATCH frames from the buddy allocator when it is empty
+Only the refill takes free_area_lock, and it stops at the min watermark unless ignore_wmark is set
+Returns NULL if the buddy allocator has no frame to give either
+*/
+
+static struct mm_page_frame * pcp_alloc(struct mm_physical_memory * mem, bool ignore_wmark)
+{
+	struct mm_per_cpu_pages * pcp;
+	struct mm_page_frame * p_frame = NULL;
+	LIST_HEAD(batch);
+	unsigned int count = 0;
+	
+	pcp = get_cpu_ptr(mem->pcp);
+	spin_lock(&pcp->lock);
+	if(pcp->count)
+	{
+		p_frame = list_first_entry(&pcp->frames, struct mm_page_frame, pf_link);
+		list_del_init(&p_frame->pf_link);
+		pcp->count--;
+	}
+	spin_unlock(&pcp->lock);
+	put_cpu_ptr(mem->pcp);
+	
+	if(p_frame)
 	{
-		p_frame = list_first_entry(&mem->free_pages, struct mm_page_frame, pf_link);
-		list_move_tail(&p_frame->pf_link, &mem->alloc_pages);
-		printk("mm_management : PAGE ALLOCATION : Allocated page frame addr:%lx\n",p_frame->physical_start_address);
+		return p_frame;
 	}
 	
-	mutex_unlock(&mem->mm_memory_mutex);
+	spin_lock(&mem->free_area_lock);
+	while(count < MM_PCP_BATCH)
+	{
+		p_frame = buddy_alloc_wmark_locked(mem, 0, ignore_wmark);
+		if(!p_frame)
+		{
+			break;
+		}
+		list_add_tail(&p_frame->pf_link, &batch);
+		count++;
+	}
+	spin_unlock(&mem->free_area_lock);
+	
+	if(!count)
+	{
+		return NULL;
+	}
+	
+	p_frame = list_first_entry(&batch, struct mm_page_frame, pf_link);
+	list_del_init(&p_frame->pf_link);
+	
+	pcp = get_cpu_ptr(mem->pcp);
+	spin_lock(&pcp->lock);
+	list_splice(&batch, &pcp->frames);
+	pcp->count += count - 1;
+	spin_unlock(&pcp->lock);
+	put_cpu_ptr(mem->pcp);
 	
 	return p_frame;
 }
 
 
-int free_page_internal(struct mm_physical_memory * mem, uintptr_t physical_addr, bool pinned_page_flag)
+/*
+This function gives a batch of frames taken off the per-cpu lists back to the buddy allocator
+*/
+
+static void pcp_free_batch(struct mm_physical_memory * mem, struct list_head * batch)
 {
-	if( (physical_addr & 0x0000000000000FFF) != (0x000) )
+	struct mm_page_frame *p_frame, *temp_p_frame;
+	
+	spin_lock(&mem->free_area_lock);
+	list_for_each_entry_safe(p_frame, temp_p_frame, batch, pf_link)
 	{
-		printk(KERN_ERR "mm_management : Invalid address given to free_page_internal(), addr:%lx\n", physical_addr);
-		return -INVALID_INPUT;
+		list_del_init(&p_frame->pf_link);
+		buddy_free_locked(mem, p_frame, 0);
 	}
+	spin_unlock(&mem->free_area_lock);
+}
 
-	struct mm_page_frame *p_frame, *temp_p_frame;
+
+/*
+This function puts a free order-0 frame on the current cpu's list
+Hot frames (likely still in the cpu cache) go to the head so they are handed out first, cold frames go to the tail
+Once the list reaches MM_PCP_HIGH the MM_PCP_BATCH coldest frames are given back to the buddy allocator
+*/
+
+void free_pcp_page(struct mm_physical_memory * mem, struct mm_page_frame * p_frame, bool cold)
+{
+	struct mm_per_cpu_pages * pcp;
+	LIST_HEAD(batch);
+	
+	p_frame->pf_flags = 0;
 	
-	mutex_lock(&mem->mm_memory_mutex);
+	pcp = get_cpu_ptr(mem->pcp);
+	spin_lock(&pcp->lock);
 	
-	if(pinned_page_flag)
-	{	
-		if(list_empty(&mem->pinned_pages))
+	if(cold)
+	{
+		list_add_tail(&p_frame->pf_link, &pcp->frames);
+	}
+	else
+	{
+		list_add(&p_frame->pf_link, &pcp->frames);
+	}
+	pcp->count++;
+	
+	if(pcp->count >= MM_PCP_HIGH)
+	{
+		for(int i = 0; i < MM_PCP_BATCH; i++)
 		{
-			printk(KERN_ERR "mm_management : No Page available in the pinned list to free\n");
-			mutex_unlock(&mem->mm_memory_mutex);
-			return -NO_PAGE_FRAME_AVAILABLE;
+			list_move(pcp->frames.prev, &batch);
+		}
+		pcp->count -= MM_PCP_BATCH;
+	}
+	
+	spin_unlock(&pcp->lock);
+	put_cpu_ptr(mem->pcp);
+	
+	if(!list_empty(&batch))
+	{
+		pcp_free_batch(mem, &batch);
+	}
+}
+
+
+/*
+This function gives the frames on every cpu's list back to the buddy allocator so they can be merged into larger blocks
+Returns the number of frames drained
+*/
+
+uintptr_t drain_all_pcp(struct mm_physical_memory * mem)
+{
+	LIST_HEAD(batch);
+	uintptr_t drained = 0;
+	int cpu;
+	
+	for_each_possible_cpu(cpu)
+	{
+		struct mm_per_cpu_pages * pcp = per_cpu_ptr(mem->pcp, cpu);
+		
+		spin_lock(&pcp->lock);
+		list_splice_init(&pcp->frames, &batch);
+		drained += pcp->count;
+		pcp->count = 0;
+		spin_unlock(&pcp->lock);
+	}
+	
+	if(drained)
+	{
+		pcp_free_batch(mem, &batch);
+	}
+	
+	return drained;
+}
+
+
+/*
+This function allocates 2^order physically contiguous page frames and moves the first frame of the block to the allocated list or pinned list based on the pinned_page_flag
+Single frames come from the per-cpu lists, larger blocks straight from the buddy allocator
+Taking a block that leaves fewer than wmark_min frames free is direct reclaim: the per-cpu lists are drained and then pages are swapped out through handle_page_fault()
+Only when reclaim can make no progress does the allocation dip below wmark_min
+Allocations that leave fewer than wmark_low frames free wake kswapd
+It returns the pointer of the first pframe of the block, the remaining frames follow it in mem->pframes
+If it returns NULL then no block of the requested size could be made available
+*/
+
+struct mm_page_frame * get_free_pages(struct mm_physical_memory * mem, unsigned int order, bool pinned_page_flag)
+{
+	struct mm_page_frame * p_frame = NULL;
+	bool ignore_wmark = false;
+	
+	if(order > MM_MAX_ORDER)
+	{
+		printk(KERN_ERR "mm_management : Invalid order given to get_free_pages(), order:%u\n", order);
+		return NULL;
+	}
+	
+	while(1)
+	{
+		if(order == 0 && (p_frame = pcp_alloc(mem, ignore_wmark)))
+		{
+			break;
 		}
 		
-		list_for_each_entry_safe(p_frame, temp_p_frame, &mem->pinned_pages, pf_link)
+		if(order > 0)
 		{
-			if(p_frame->physical_start_address == physical_addr)
+			spin_lock(&mem->free_area_lock);
+			p_frame = buddy_alloc_wmark_locked(mem, order, ignore_wmark);
+			spin_unlock(&mem->free_area_lock);
+			
+			if(p_frame)
 			{
-				list_move_tail(&p_frame->pf_link, &mem->free_pages);
-				mutex_unlock(&mem->mm_memory_mutex);
-				return 0;
+				break;
 			}
 		}
 		
-		printk(KERN_ERR "mm_management : Given page is not available in the pinned list\n");
+		mm_kswapd_wakeup(mem);
+		
+		if(!drain_all_pcp(mem))
+		{
+			uintptr_t nr_needed = 1UL << order;
+			
+			if(handle_page_fault(mem, PAGE_FAULT_NO_PAGE, &nr_needed))
+			{
+				if(ignore_wmark)
+				{
+					return NULL;
+				}
+				ignore_wmark = true;
+			}
+			else
+			{
+				atomic_long_inc(&mem->nr_direct_reclaimed);
+			}
+		}
+	}
+	
+	mm_kswapd_check_wmark(mem);
+	
+	spin_lock(&mem->alloc_lists_lock);
+	if(pinned_page_flag)
+	{
+		list_add_tail(&p_frame->pf_link, &mem->pinned_pages);
+		p_frame->pf_flags = p_frame->pf_flags | PF_PINNED;
 	}
 	else
 	{
-		if(list_empty(&mem->alloc_pages))
+		list_add_tail(&p_frame->pf_link, &mem->alloc_pages);
+		mem->nr_alloc_pages++;
+		p_frame->pf_flags = p_frame->pf_flags | PF_ALLOCATED;
+		atomic_set(&p_frame->pf_refcount, 1);
+		atomic_set(&p_frame->pf_mapcount, 1);
+		if(order == 0)
 		{
-			printk(KERN_ERR "mm_management : No Page available in the allocated list to free\n");
-			mutex_unlock(&mem->mm_memory_mutex);
-			return -NO_PAGE_FRAME_AVAILABLE;
+			spin_lock(&mem->lru_lock);
+			lru_add_locked(mem, p_frame);
+			spin_unlock(&mem->lru_lock);
+		}
+	}
+	spin_unlock(&mem->alloc_lists_lock);
+	
+	printk("mm_management : PAGE ALLOCATION : %s page frame addr:%lx, order:%u\n", pinned_page_flag ? "Pinned" : "Allocated", p_frame->physical_start_address, order);
+	
+	return p_frame;
+}
+
+
+/*
+This function allocates nr_pages single page frames, taking free_area_lock once for as many frames as the buddy allocator can give
+The frames are returned on the frames list linked through pf_link and are not yet on the allocated list, the caller puts them there once they are mapped
+Returns 0, or an error after giving every frame back if reclaim could not make enough frames available
+*/
+
+int get_free_pages_bulk(struct mm_physical_memory * mem, uintptr_t nr_pages, struct list_head * frames)
+{
+	struct mm_page_frame * p_frame;
+	uintptr_t count = 0;
+	bool ignore_wmark = false;
+	
+	while(1)
+	{
+		spin_lock(&mem->free_area_lock);
+		while(count < nr_pages && (p_frame = buddy_alloc_wmark_locked(mem, 0, ignore_wmark)))
+		{
+			list_add_tail(&p_frame->pf_link, frames);
+			count++;
+		}
+		spin_unlock(&mem->free_area_lock);
+		
+		if(count == nr_pages)
+		{
+			break;
+		}
+		
+		mm_kswapd_wakeup(mem);
+		
+		if(!drain_all_pcp(mem))
+		{
+			uintptr_t nr_needed = nr_pages - count;
+			
+			if(handle_page_fault(mem, PAGE_FAULT_NO_PAGE, &nr_needed))
+			{
+				if(ignore_wmark)
+				{
+					free_pages_bulk(mem, frames);
+					return -NO_PAGE_FRAME_AVAILABLE;
+				}
+				ignore_wmark = true;
+			}
+			else
+			{
+				atomic_long_inc(&mem->nr_direct_reclaimed);
+			}
+		}
+	}
+	
+	mm_kswapd_check_wmark(mem);
+	
+	printk("mm_management : PAGE ALLOCATION : Allocated %lu page frames in bulk\n", nr_pages);
+	
+	return 0;
+}
+
+
+/*
+This function gives a list of single page frames, linked through pf_link and on no other list, back to the buddy allocator with one acquisition of free_area_lock
+*/
+
+void free_pages_bulk(struct mm_physical_memory * mem, struct list_head * frames)
+{
+	struct mm_page_frame *p_frame, *temp_p_frame;
+	
+	spin_lock(&mem->free_area_lock);
+	list_for_each_entry_safe(p_frame, temp_p_frame, frames, pf_link)
+	{
+		list_del_init(&p_frame->pf_link);
+		p_frame->pf_flags = 0;
+		
+		// As in free_page_internal(), a stale reference taken with atomic_inc_not_zero() must fail on a free frame
+		atomic_set(&p_frame->pf_refcount, 0);
+		atomic_set(&p_frame->pf_mapcount, 0);
+		
+		buddy_free_locked(mem, p_frame, 0);
+	}
+	spin_unlock(&mem->free_area_lock);
+}
+
+
+/*
+This function allocates a single page frame, see get_free_pages()
+*/
+
+struct mm_page_frame * get_free_page_internal(struct mm_physical_memory * mem, bool pinned_page_flag)
+{
+	return get_free_pages(mem, 0, pinned_page_flag);
+}
+
+
+/*
+This function gives the block of page frames that starts at physical_addr back to the buddy allocator
+The frame is looked up directly in mem->pframes, pinned_page_flag must match the list the frame is currently on
+*/
+
+int free_page_internal(struct mm_physical_memory * mem, uintptr_t physical_addr, bool pinned_page_flag)
+{
+	if( (physical_addr & 0x0000000000000FFF) != (0x000) || !is_valid_physical_address(mem, physical_addr) )
+	{
+		printk(KERN_ERR "mm_management : Invalid address given to free_page_internal(), addr:%lx\n", physical_addr);
+		return -INVALID_INPUT;
+	}
+
+	struct mm_page_frame * p_frame = phys_to_pframe(mem, physical_addr);
+	uint8_t list_flag = pinned_page_flag ? PF_PINNED : PF_ALLOCATED;
+	
+	spin_lock(&mem->alloc_lists_lock);
+	
+	if( !(p_frame->pf_flags & list_flag) )
+	{
+		printk(KERN_ERR "mm_management : Given page is not available in the %s list\n", pinned_page_flag ? "pinned" : "allocated");
+		spin_unlock(&mem->alloc_lists_lock);
+		return -NO_PAGE_FRAME_AVAILABLE;
+	}
+	
+	spin_lock(&mem->lru_lock);
+	lru_del_locked(mem, p_frame);
+	p_frame->pf_flags = p_frame->pf_flags & ~list_flag;
+	spin_unlock(&mem->lru_lock);
+	list_del_init(&p_frame->pf_link);
+	if(!pinned_page_flag)
+	{
+		mem->nr_alloc_pages--;
+	}
+	
+	// A free frame holds no reference, so atomic_inc_not_zero() on a frame picked without a reference fails on it
+	atomic_set(&p_frame->pf_refcount, 0);
+	
+	spin_unlock(&mem->alloc_lists_lock);
+	
+	// Pinned frames hold page tables, make sure no walk starts at a freed one
+	if(pinned_page_flag)
+	{
+		mm_pwc_flush_all(mem->pwc);
+	}
+	
+	if(p_frame->order == 0)
+	{
+		free_pcp_page(mem, p_frame, 0);
+	}
+	else
+	{
+		spin_lock(&mem->free_area_lock);
+		buddy_free_locked(mem, p_frame, p_frame->order);
+		spin_unlock(&mem->free_area_lock);
+	}
+	
+	return 0;
+}
+
+
+/*
+This function frees a page table page that has already been unlinked from its parent entry
+Lockless walks may still be reading it, so it is only given back to the allocator after an RCU grace period
+Caller must not hold alloc_lists_lock, lru_lock or any page table lock
+*/
+
+void free_page_table_rcu(struct mm_physical_memory * mem, struct mm_page_frame * p_frame)
+{
+	spin_lock(&mem->alloc_lists_lock);
+	p_frame->pf_flags = p_frame->pf_flags & ~PF_PINNED;
+	list_del_init(&p_frame->pf_link);
+	spin_unlock(&mem->alloc_lists_lock);
+	
+	mm_pwc_flush_all(mem->pwc);
+	
+	spin_lock(&mem->pt_free_lock);
+	list_add_tail(&p_frame->pf_link, &mem->pt_free_pending);
+	
+	// Frames unlinked before the grace period is requested are covered by it, later ones wait for the next one
+	if(!mem->pt_free_queued)
+	{
+		list_splice_tail_init(&mem->pt_free_pending, &mem->pt_free_waiting);
+		mem->pt_free_queued = true;
+		queue_rcu_work(system_wq, &mem->pt_free_work);
+	}
+	spin_unlock(&mem->pt_free_lock);
+}
+
+
+static void page_table_free_work_fn(struct work_struct * work)
+{
+	struct mm_physical_memory * mem = container_of(to_rcu_work(work), struct mm_physical_memory, pt_free_work);
+	struct mm_page_frame *p_frame, *temp_p_frame;
+	LIST_HEAD(frames);
+	
+	spin_lock(&mem->pt_free_lock);
+	list_splice_init(&mem->pt_free_waiting, &frames);
+	if(!list_empty(&mem->pt_free_pending))
+	{
+		list_splice_tail_init(&mem->pt_free_pending, &mem->pt_free_waiting);
+		queue_rcu_work(system_wq, &mem->pt_free_work);
+	}
+	else
+	{
+		mem->pt_free_queued = false;
+	}
+	spin_unlock(&mem->pt_free_lock);
+	
+	// A walk that started before the grace period may have cached one of these tables after it was unlinked
+	mm_pwc_flush_all(mem->pwc);
+	
+	list_for_each_entry_safe(p_frame, temp_p_frame, &frames, pf_link)
+	{
+		list_del_init(&p_frame->pf_link);
+		free_pcp_page(mem, p_frame, 1);
+	}
+}
+
+
+/*
+This function waits until every page table page passed to free_page_table_rcu() has been freed
+*/
+
+void drain_page_table_frees(struct mm_physical_memory * mem)
+{
+	while(READ_ONCE(mem->pt_free_queued))
+	{
+		flush_rcu_work(&mem->pt_free_work);
+	}
+}
+
+
+/*
+This function sets the page table entries
+pfn : 52 bit physical page frame number or physical page frame starting address >> 12
+returns uintptr_t with it reference and validity bit set(i.e., 54 and 53 bits)
+*/
+
+inline uintptr_t set_PTE(uintptr_t pfn)
+{
+	return pfn | PTE_VALID | PTE_REFERENCE;
+}
+
+
+/*
+This function sets the page table entries
+pfn : 52 bit physical page frame number or physical page frame starting address >> 12
+returns uintptr_t with it reference and validity bit set(i.e., 54 and 53 bits)
+*/
+
+inline uintptr_t set_PTE_Reference_bit(uintptr_t pfn)
+{
+	return pfn | PTE_REFERENCE;
+}
+
+
+/*
+This function requests an page to the kernel
+The page is mapped at a free virtual address of the calling pid's address space, addresses freed earlier are reused
+Returns the starting virtual address of the page frame
+*/
+
+int get_free_page(struct mm_physical_memory * mem, uintptr_t * addr)
+{
+	//printk("DEBUG : get_free_page\n");
+	struct mm_address_space * as = mm_get_address_space(mem, current->pid);
+	uintptr_t virtual_address;
+	
+	if(!as)
+	{
+		return -1;
+	}
+	
+	struct mm_page_frame * p_frame = get_free_page_internal(mem, 0);
+	
+	if(!p_frame)
+	{
+		return -1;
+	}
+	
+	if(mm_mmap(as, 1, 0x01000, 0, &virtual_address))
+	{
+		free_page_internal(mem, p_frame->physical_start_address, 0);
+		return -1;
+	}
+	
+	int err = update_page_table(mem, as, virtual_address, p_frame->physical_start_address);
+	if(err)
+	{
+		free_page_internal(mem, p_frame->physical_start_address, 0);
+		if(mm_munmap(as, virtual_address, 1))
+		{
+			printk(KERN_ERR "mm_management : Virtual range could not be released, addr:%lx\n", virtual_address);
+		}
+		return -1;
+	}
+	else
+	{
+		p_frame->virtual_start_address = virtual_address;
+		p_frame->pid = current->pid;
+		atomic_long_inc(&as->nr_mapped_pages);
+		
+		//printk("DEBUG : p_frame->virtual_start_address:%lx, p_frame->pid:%d\n", p_frame->virtual_start_address, p_frame->pid);
+		
+		(* addr) = virtual_address;
+		return 0;
+	}
+}
+
+
+/*
+This function requests a 2 MiB huge page, backed by an order HUGE_PAGE_ORDER block of the buddy allocator
+Returns the starting virtual address of the huge page, which is HUGE_PAGE_SIZE_EXP aligned
+*/
+
+int get_free_huge_page(struct mm_physical_memory * mem, uintptr_t * addr)
+{
+	struct mm_address_space * as = mm_get_address_space(mem, current->pid);
+	uintptr_t virtual_address;
+	
+	if(!as)
+	{
+		return -1;
+	}
+	
+	struct mm_page_frame * p_frame = get_free_pages(mem, HUGE_PAGE_ORDER, 0);
+	
+	if(!p_frame)
+	{
+		return -1;
+	}
+	
+	if(mm_mmap(as, 1UL << HUGE_PAGE_ORDER, HUGE_PAGE_SIZE_EXP, 0, &virtual_address))
+	{
+		free_page_internal(mem, p_frame->physical_start_address, 0);
+		return -1;
+	}
+	
+	int err = update_page_table_huge(mem, as, virtual_address, p_frame->physical_start_address);
+	if(err)
+	{
+		free_page_internal(mem, p_frame->physical_start_address, 0);
+		if(mm_munmap(as, virtual_address, 1UL << HUGE_PAGE_ORDER))
+		{
+			printk(KERN_ERR "mm_management : Virtual range could not be released, addr:%lx\n", virtual_address);
+		}
+		return -1;
+	}
+	
+	p_frame->pf_flags = p_frame->pf_flags | PF_HUGE;
+	p_frame->virtual_start_address = virtual_address;
+	p_frame->pid = current->pid;
+	atomic_long_add(1L << HUGE_PAGE_ORDER, &as->nr_mapped_pages);
+	
+	(* addr) = virtual_address;
+	return 0;
+}
+
+
+/*
+This function reserves nr_pages virtual pages in the calling pid's address space without backing them by frames
+Each page gets a zero filled frame on its first translation fault (mm_demand_page_fault()), pages that are never touched cost no frame and are never swapped
+Returns the starting virtual address of the range in (* addr)
+*/
+
+int mm_map_range_lazy(struct mm_physical_memory * mem, uintptr_t nr_pages, uintptr_t * addr)
+{
+	struct mm_address_space * as = mm_get_address_space(mem, current->pid);
+	
+	if(!nr_pages)
+	{
+		return -INVALID_INPUT;
+	}
+	
+	if(!as)
+	{
+		return -NO_PAGE_FRAME_AVAILABLE;
+	}
+	
+	return mm_mmap(as, nr_pages, 0x01000, MM_VM_LAZY, addr);
+}
+
+
+/*
+This function is the lazy counterpart of get_free_page(), the page is only reserved
+*/
+
+int get_free_page_lazy(struct mm_physical_memory * mem, uintptr_t * addr)
+{
+	return mm_map_range_lazy(mem, 1, addr);
+}
+
+
+/*
+This function handles the first translation fault on a page of a range reserved with MM_VM_LAZY by mapping a zero filled frame
+A page that a concurrent fault mapped first is left as it is and its frame is used
+Returns -WRONG_VALUE if virtual_pframe_addr is not in such a range
+*/
+
+int mm_demand_page_fault(struct mm_physical_memory * mem, pid_t pid, uintptr_t virtual_pframe_addr)
+{
+	struct mm_address_space * as = mm_find_address_space(mem, pid);
+	struct mm_page_frame * p_frame;
+	unsigned long vm_flags;
+	int err;
+	
+	if( !as || mm_vma_lookup_flags(as, virtual_pframe_addr, &vm_flags) || !(vm_flags & MM_VM_LAZY) )
+	{
+		return -WRONG_VALUE;
+	}
+	
+	p_frame = get_free_page_internal(mem, 0);
+	if(!p_frame)
+	{
+		return -NO_PAGE_FRAME_AVAILABLE;
+	}
+	
+	memset((void *)p_frame->physical_start_address, 0, PAGE_SIZE_EXP);
+	p_frame->virtual_start_address = virtual_pframe_addr;
+	p_frame->pid = pid;
+	
+	err = update_page_table(mem, as, virtual_pframe_addr, p_frame->physical_start_address);
+	if(err)
+	{
+		free_page_internal(mem, p_frame->physical_start_address, 0);
+		
+		// A concurrent fault on the same page mapped it first
+		return err == -PAGE_ALREADY_MAPPED ? 0 : err;
+	}
+	
+	atomic_long_inc(&as->nr_mapped_pages);
+	atomic_long_inc(&as->nr_demand_faults);
+	
+	return 0;
+}
+
+
+/*
+This function finds the page table the walk of vfn starts at
+A paging-structure cache hit skips levels 1-3 (level 4 table cached) or levels 1-2 (level 3 table cached), otherwise the walk starts at the root of as
+Returns the level of (* page_table_addr)
+*/
+
+static uintptr_t get_walk_start(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t vfn, uintptr_t * page_table_addr)
+{
+	uintptr_t level;
+	
+	if(mm_pwc_lookup(mem->pwc, as->cr3_page_table_addr, vfn, page_table_addr, &level))
+	{
+		return level;
+	}
+	
+	*page_table_addr = as->cr3_page_table_addr;
+	return 1;
+}
+
+
+/*
+This function caches the level 3 and level 4 page tables reached by a walk, next_page_addr is the result of walking the given level
+*/
+
+static inline void cache_walk_level(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t vfn, uintptr_t level, uintptr_t next_page_addr)
+{
+	if(level == 2 || level == 3)
+	{
+		mm_pwc_insert(mem->pwc, as->cr3_page_table_addr, vfn, level + 1, next_page_addr);
+	}
+}
+
+
+/*
+This function walks levels 1-3 for vfn and returns the level 4 page table covering it in (* page_table_addr)
+If alloc_flag is set missing page tables are allocated the way update_page_table() does, otherwise a missing table or a huge entry on the way is an error
+Caller must hold rcu_read_lock() and keep it until the table is locked, with alloc_flag it is dropped while a table is allocated
+*/
+
+int get_leaf_page_table(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t vfn, bool alloc_flag, uintptr_t * page_table_addr)
+{
+	struct mm_page_frame * new_table = NULL;
+	int err = 0;
+	
+retry:
+	for(uintptr_t level = get_walk_start(mem, as, vfn, page_table_addr); level <= 3; level++)
+	{
+		if(alloc_flag)
+		{
+			err = update_multilevel_pagetables(mem, as, vfn, level, *page_table_addr, 0, &new_table, page_table_addr);
+			if(err == PAGE_WALK_RETRY)
+			{
+				goto retry;
+			}
+			if(err)
+			{
+				break;
+			}
+		}
+		else
+		{
+			uintptr_t pte = READ_ONCE(*get_PTE_address(vfn, level, *page_table_addr));
+			
+			if( !(pte & PTE_VALID) || (pte & PTE_HUGE) )
+			{
+				err = -WRONG_VALUE;
+				break;
+			}
+			*page_table_addr = (pte & PTE_PFN_MASK) << 12;
+		}
+		cache_walk_level(mem, as, vfn, level, *page_table_addr);
+	}
+	
+	// Another walk installed the table first
+	if(new_table)
+	{
+		free_page_internal(mem, new_table->physical_start_address, 1);
+	}
+	
+	return err;
+}
+
+
+/*
+This function finds the level 4 page table covering vfn like get_leaf_page_table() and returns with its page table lock held
+rcu_read_lock() keeps the table from being freed until its lock is taken, and a table unlinked before that is looked up again
+Returns the error of get_leaf_page_table() without holding any lock if no level 4 page table covers vfn
+*/
+
+static int lock_leaf_page_table(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t vfn, uintptr_t * page_table_addr)
+{
+	int err;
+	
+	rcu_read_lock();
+	
+retry:
+	err = get_leaf_page_table(mem, as, vfn, 0, page_table_addr);
+	if(!err)
+	{
+		spin_lock(pte_lockptr(mem, *page_table_addr));
+		
+		if(phys_to_pframe(mem, *page_table_addr)->pt_unlinked)
+		{
+			spin_unlock(pte_lockptr(mem, *page_table_addr));
+			goto retry;
+		}
+	}
+	
+	rcu_read_unlock();
+	
+	return err;
+}
+
+
+/*
+This function frees the page tables on the walk to vfn that have no valid entry left, from the deepest one up for as long as the parent becomes empty too
+An empty table is unlinked under the locks of its parent and itself and marked pt_unlinked, so a walk that found it before that retries from the root
+instead of filling an entry nobody can reach, and its frame is only freed after a grace period since lockless walks may still read it
+Caller must not hold a page table lock
+*/
+
+void free_empty_page_tables(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t vfn)
+{
+	uintptr_t tables[5]; // tables[level] is the level page table on the walk to vfn
+	uintptr_t depth;
+	
+	rcu_read_lock();
+	
+	tables[1] = as->cr3_page_table_addr;
+	for(depth = 1; depth <= 3; depth++)
+	{
+		uintptr_t pte = READ_ONCE(*get_PTE_address(vfn, depth, tables[depth]));
+		
+		if( !(pte & PTE_VALID) || (pte & PTE_HUGE) )
+		{
+			break;
+		}
+		tables[depth + 1] = (pte & PTE_PFN_MASK) << 12;
+	}
+	
+	// The root is never freed
+	for(uintptr_t level = min_t(uintptr_t, depth, 4); level >= 2; level--)
+	{
+		struct mm_page_frame * parent = phys_to_pframe(mem, tables[level - 1]);
+		struct mm_page_frame * child = phys_to_pframe(mem, tables[level]);
+		uintptr_t * pte_address = get_PTE_address(vfn, level - 1, tables[level - 1]);
+		bool unlinked = false;
+		
+		// Both locks belong to the same lock class, lockdep is told the child nests inside its parent
+		spin_lock(&parent->ptl);
+		spin_lock_nested(&child->ptl, SINGLE_DEPTH_NESTING);
+		
+		if( !child->pt_nr_used && !child->pt_unlinked && (*pte_address & PTE_VALID) && ((*pte_address & PTE_PFN_MASK) << 12) == tables[level] )
+		{
+			child->pt_unlinked = true;
+			WRITE_ONCE(*pte_address, 0);
+			parent->pt_nr_used--;
+			unlinked = true;
+		}
+		
+		spin_unlock(&child->ptl);
+		spin_unlock(&parent->ptl);
+		
+		if(!unlinked)
+		{
+			break;
+		}
+		
+		atomic_long_dec(&as->nr_page_tables);
+		free_page_table_rcu(mem, child);
+	}
+	
+	rcu_read_unlock();
+}
+
+
+/*
+This function calls free_empty_page_tables() for every level 4 page table covering the nr_pages pages from vfn
+*/
+
+static void free_empty_page_tables_range(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t vfn, uintptr_t nr_pages)
+{
+	for(uintptr_t table_vfn = vfn & ~0x01FFUL; table_vfn < vfn + nr_pages; table_vfn += 512)
+	{
+		free_empty_page_tables(mem, as, table_vfn);
+	}
+}
+
+
+/*
+This function clears the PTEs of nr_pages pages from vfn that mm_map_range() already filled before it failed
+*/
+
+static void unmap_partial_range(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t vfn, uintptr_t nr_pages)
+{
+	uintptr_t page_table_addr;
+	uintptr_t done = 0;
+	
+	while(done < nr_pages)
+	{
+		uintptr_t run = min(nr_pages - done, 512 - ((vfn + done) & 0x01FF));
+		
+		if(!lock_leaf_page_table(mem, as, vfn + done, &page_table_addr))
+		{
+			uintptr_t * pte_address = get_PTE_address(vfn + done, 4, page_table_addr);
+			
+			for(uintptr_t i = 0; i < run; i++)
+			{
+				if(pte_address[i] & PTE_VALID)
+				{
+					phys_to_pframe(mem, page_table_addr)->pt_nr_used--;
+				}
+				WRITE_ONCE(pte_address[i], 0);
+			}
+			spin_unlock(pte_lockptr(mem, page_table_addr));
+		}
+		done += run;
+	}
+	
+	mm_tlb_flush_range(mem->tlb, as->pid, vfn, nr_pages);
+	
+	free_empty_page_tables_range(mem, as, vfn, nr_pages);
+}
+
+
+/*
+This function maps nr_pages consecutive virtual pages to frames taken from the buddy allocator in one bulk allocation
+The level 4 page table of every 512 page stretch is found with a single walk and its entries are filled in a row
+Returns the starting virtual address of the range in (* addr)
+*/
+
+int mm_map_range(struct mm_physical_memory * mem, uintptr_t nr_pages, uintptr_t * addr)
+{
+	struct mm_address_space * as = mm_get_address_space(mem, current->pid);
+	LIST_HEAD(frames);
+	struct mm_page_frame * p_frame;
+	uintptr_t virtual_address;
+	uintptr_t vfn;
+	uintptr_t page_table_addr;
+	uintptr_t mapped = 0;
+	int err;
+	
+	if(!nr_pages)
+	{
+		return -INVALID_INPUT;
+	}
+	
+	if(!as)
+	{
+		return -NO_PAGE_FRAME_AVAILABLE;
+	}
+	
+	err = get_free_pages_bulk(mem, nr_pages, &frames);
+	if(err)
+	{
+		return err;
+	}
+	
+	err = mm_mmap(as, nr_pages, 0x01000, 0, &virtual_address);
+	if(err)
+	{
+		free_pages_bulk(mem, &frames);
+		return err;
+	}
+	vfn = virtual_address >> 12;
+	
+	p_frame = list_first_entry(&frames, struct mm_page_frame, pf_link);
+	
+	while(mapped < nr_pages)
+	{
+		// rcu_read_lock() keeps the table from being freed until its lock is taken and pt_unlinked is checked
+		rcu_read_lock();
+		
+		err = get_leaf_page_table(mem, as, vfn + mapped, 1, &page_table_addr);
+		if(err)
+		{
+			rcu_read_unlock();
+			unmap_partial_range(mem, as, vfn, mapped);
+			free_pages_bulk(mem, &frames);
+			if(mm_munmap(as, virtual_address, nr_pages))
+			{
+				printk(KERN_ERR "mm_management : Virtual range could not be released, addr:%lx\n", virtual_address);
+			}
+			return err;
+		}
+		
+		uintptr_t * pte_address = get_PTE_address(vfn + mapped, 4, page_table_addr);
+		uintptr_t run = min(nr_pages - mapped, 512 - ((vfn + mapped) & 0x01FF));
+		struct mm_page_frame * table = phys_to_pframe(mem, page_table_addr);
+		
+		spin_lock(&table->ptl);
+		
+		// The table became empty and was unlinked since it was found, walk again
+		if(table->pt_unlinked)
+		{
+			spin_unlock(&table->ptl);
+			rcu_read_unlock();
+			continue;
+		}
+		
+		rcu_read_unlock();
+		
+		for(uintptr_t i = 0; i < run; i++)
+		{
+			if( !(pte_address[i] & PTE_VALID) )
+			{
+				table->pt_nr_used++;
+			}
+			WRITE_ONCE(pte_address[i], set_PTE( p_frame->physical_start_address >> 12 ));
+			p_frame->virtual_start_address = (vfn + mapped + i) << 12;
+			p_frame->pid = current->pid;
+			atomic_set(&p_frame->pf_refcount, 1);
+			atomic_set(&p_frame->pf_mapcount, 1);
+			p_frame = list_next_entry(p_frame, pf_link);
+		}
+		spin_unlock(&table->ptl);
+		
+		mapped += run;
+	}
+	
+	spin_lock(&mem->alloc_lists_lock);
+	spin_lock(&mem->lru_lock);
+	list_for_each_entry(p_frame, &frames, pf_link)
+	{
+		p_frame->pf_flags = p_frame->pf_flags | PF_ALLOCATED;
+		lru_add_locked(mem, p_frame);
+	}
+	spin_unlock(&mem->lru_lock);
+	list_splice_tail(&frames, &mem->alloc_pages);
+	mem->nr_alloc_pages += nr_pages;
+	spin_unlock(&mem->alloc_lists_lock);
+	
+	atomic_long_add(nr_pages, &as->nr_mapped_pages);
+	
+	(* addr) = virtual_address;
+	return 0;
+}
+
+
+/*
+This function checks whether a level 3 huge entry maps any of the nr_pages pages from vfn
+*/
+
+static bool range_has_huge_mapping(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t vfn, uintptr_t nr_pages)
+{
+	uintptr_t page_table_addr;
+	bool found = false;
+	
+	rcu_read_lock();
+	
+	for(uintptr_t table_vfn = vfn & ~0x01FFUL; table_vfn < vfn + nr_pages && !found; table_vfn += 512)
+	{
+		for(uintptr_t level = get_walk_start(mem, as, table_vfn, &page_table_addr); level <= 3; level++)
+		{
+			uintptr_t pte = READ_ONCE(*get_PTE_address(table_vfn, level, page_table_addr));
+			
+			if( !(pte & PTE_VALID) )
+			{
+				break;
+			}
+			if(pte & PTE_HUGE)
+			{
+				found = true;
+				break;
+			}
+			page_table_addr = (pte & PTE_PFN_MASK) << 12;
+		}
+	}
+	
+	rcu_read_unlock();
+	
+	return found;
+}
+
+
+/*
+This function unmaps nr_pages consecutive virtual pages starting at virtual_addr and frees their frames
+Every level 4 page table in the range is walked once and its entries are cleared in a row under its page table lock,
+while the frames are taken off the allocated list and the LRU under a single acquisition of alloc_lists_lock and lru_lock
+The frames then go back to the buddy allocator in one batch and the TLB is shot down once for the whole range
+Stretches without a level 4 page table are skipped, as are entries that are not valid
+Finally swapped out pages of the range are dropped, page tables left empty are freed and the range is released for reuse
+A range overlapping a huge page is rejected before anything is unmapped, a huge page has to be freed with mm_free_page()
+*/
+
+int mm_unmap_range(struct mm_physical_memory * mem, uintptr_t virtual_addr, uintptr_t nr_pages)
+{
+	return mm_unmap_range_as(mem, mm_find_address_space(mem, current->pid), virtual_addr, nr_pages);
+}
+
+
+/*
+This function is mm_unmap_range() for the address space as, which need not be the one of current
+*/
+
+int mm_unmap_range_as(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t virtual_addr, uintptr_t nr_pages)
+{
+	LIST_HEAD(frames);
+	struct mm_page_frame * p_frame;
+	uintptr_t vfn = virtual_addr >> 12;
+	uintptr_t page_table_addr;
+	uintptr_t done = 0;
+	uintptr_t unmapped = 0;
+	bool emptied = false;
+	
+	if( (virtual_addr & 0x0000000000000FFF) || !nr_pages || !as )
+	{
+		printk(KERN_ERR "mm_management : Invalid range given to mm_unmap_range_as(), addr:%lx, pages:%lu\n", virtual_addr, nr_pages);
+		return -INVALID_INPUT;
+	}
+	
+	// Releasing the range would free virtual addresses that the huge page still maps
+	if(range_has_huge_mapping(mem, as, vfn, nr_pages))
+	{
+		printk(KERN_ERR "mm_management : Range given to mm_unmap_range_as() overlaps a huge page, addr:%lx, pages:%lu\n", virtual_addr, nr_pages);
+		return -INVALID_INPUT;
+	}
+	
+	spin_lock(&mem->alloc_lists_lock);
+	spin_lock(&mem->lru_lock);
+	
+	while(done < nr_pages)
+	{
+		uintptr_t run = min(nr_pages - done, 512 - ((vfn + done) & 0x01FF));
+		
+		if(!lock_leaf_page_table(mem, as, vfn + done, &page_table_addr))
+		{
+			uintptr_t * pte_address = get_PTE_address(vfn + done, 4, page_table_addr);
+			
+			for(uintptr_t i = 0; i < run; i++)
+			{
+				if( !(pte_address[i] & PTE_VALID) )
+				{
+					continue;
+				}
+				
+				p_frame = phys_to_pframe(mem, (pte_address[i] & PTE_PFN_MASK) << 12);
+				WRITE_ONCE(pte_address[i], 0);
+				unmapped++;
+				
+				if(!--phys_to_pframe(mem, page_table_addr)->pt_nr_used)
+				{
+					emptied = true;
+				}
+				
+				// A frame still shared copy-on-write, or held by a copy in progress, is freed by its last user
+				atomic_dec(&p_frame->pf_mapcount);
+				if(!atomic_dec_and_test(&p_frame->pf_refcount))
+				{
+					continue;
+				}
+				
+				if( (p_frame->pf_flags & PF_ALLOCATED) && p_frame->order == 0 )
+				{
+					lru_del_locked(mem, p_frame);
+					p_frame->pf_flags = p_frame->pf_flags & ~PF_ALLOCATED;
+					list_move_tail(&p_frame->pf_link, &frames);
+					mem->nr_alloc_pages--;
+				}
+			}
+			
+			spin_unlock(pte_lockptr(mem, page_table_addr));
+		}
+		
+		done += run;
+	}
+	
+	spin_unlock(&mem->lru_lock);
+	spin_unlock(&mem->alloc_lists_lock);
+	
+	mm_tlb_flush_range(mem->tlb, as->pid, vfn, nr_pages);
+	
+	free_pages_bulk(mem, &frames);
+	
+	atomic_long_sub(unmapped, &as->nr_mapped_pages);
+	
+	swap_discard_range(as->pid, virtual_addr, nr_pages);
+	
+	if(emptied)
+	{
+		free_empty_page_tables_range(mem, as, vfn, nr_pages);
+	}
+	
+	printk("mm_management : PAGE FREE : Unmapped %lu of %lu pages from addr:%lx\n", unmapped, nr_pages, virtual_addr);
+	
+	return mm_munmap(as, virtual_addr, nr_pages);
+}
+
+
+/*
+This function drops a reference to an allocated frame and frees the frame with the last one
+*/
+
+void mm_put_page(struct mm_physical_memory * mem, struct mm_page_frame * p_frame)
+{
+	if(atomic_dec_and_test(&p_frame->pf_refcount))
+	{
+		free_page_internal(mem, p_frame->physical_start_address, 0);
+	}
+}
+
+
+/*
+This function handles a write through the PTE_READ_ONLY entry of vfn in as
+A frame no other PTE maps any more is reused and made writable, otherwise the page is copied into a new frame whose PTE replaces the shared one
+The shared frame is copied outside the page table lock, held by a temporary reference so that its other mappers cannot free it meanwhile
+If the entry changed under the copy the new frame is dropped and the walk that follows sees the new entry
+*/
+
+static int do_wp_page(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t vfn)
+{
+	struct mm_page_frame * old_frame;
+	struct mm_page_frame * new_frame;
+	struct mm_page_frame * table;
+	uintptr_t page_table_addr;
+	uintptr_t * pte_address;
+	uintptr_t pte;
+	
+	// rcu_read_lock() keeps the table from being freed until its lock is taken and pt_unlinked is checked
+	rcu_read_lock();
+	
+	if(get_leaf_page_table(mem, as, vfn, 0, &page_table_addr))
+	{
+		rcu_read_unlock();
+		return 0;
+	}
+	
+	table = phys_to_pframe(mem, page_table_addr);
+	pte_address = get_PTE_address(vfn, 4, page_table_addr);
+	
+	spin_lock(&table->ptl);
+	
+	pte = *pte_address;
+	if( table->pt_unlinked || !(pte & PTE_VALID) || !(pte & PTE_READ_ONLY) )
+	{
+		spin_unlock(&table->ptl);
+		rcu_read_unlock();
+		return 0;
+	}
+	
+	old_frame = phys_to_pframe(mem, (pte & PTE_PFN_MASK) << 12);
+	
+	// A frame held by anyone else, like a stable frame of the KSM scanner, is copied even with a single mapping
+	if(atomic_read(&old_frame->pf_mapcount) == 1 && atomic_read(&old_frame->pf_refcount) == 1)
+	{
+		// Every other mapper copied or unmapped the page, so it is private to as again
+		old_frame->virtual_start_address = vfn << 12;
+		old_frame->pid = as->pid;
+		WRITE_ONCE(*pte_address, pte & ~PTE_READ_ONLY);
+		
+		spin_unlock(&table->ptl);
+		rcu_read_unlock();
+		
+		atomic_long_inc(&as->nr_cow_faults);
+		return 0;
+	}
+	
+	atomic_inc(&old_frame->pf_refcount);
+	
+	spin_unlock(&table->ptl);
+	rcu_read_unlock();
+	
+	new_frame = get_free_page_internal(mem, 0);
+	if(!new_frame)
+	{
+		mm_put_page(mem, old_frame);
+		return -NO_PAGE_FRAME_AVAILABLE;
+	}
+	
+	memcpy((void *)new_frame->physical_start_address, (void *)old_frame->physical_start_address, PAGE_SIZE_EXP);
+	new_frame->virtual_start_address = vfn << 12;
+	new_frame->pid = as->pid;
+	
+	rcu_read_lock();
+	
+	if(!get_leaf_page_table(mem, as, vfn, 0, &page_table_addr))
+	{
+		table = phys_to_pframe(mem, page_table_addr);
+		pte_address = get_PTE_address(vfn, 4, page_table_addr);
+		
+		spin_lock(&table->ptl);
+		
+		// Walks may have set the reference bit meanwhile, any other change means the entry is no longer the one that faulted
+		if( !table->pt_unlinked && !((*pte_address ^ pte) & ~PTE_REFERENCE) )
+		{
+			WRITE_ONCE(*pte_address, set_PTE( new_frame->physical_start_address >> 12 ));
+			atomic_dec(&old_frame->pf_mapcount);
+			
+			// Drops the reference of the replaced mapping, the temporary one keeps the frame allocated
+			atomic_dec(&old_frame->pf_refcount);
+			new_frame = NULL;
+		}
+		
+		spin_unlock(&table->ptl);
+	}
+	
+	rcu_read_unlock();
+	
+	if(new_frame)
+	{
+		free_page_internal(mem, new_frame->physical_start_address, 0);
+	}
+	else
+	{
+		mm_tlb_flush_page(mem->tlb, as->pid, vfn);
+		atomic_long_inc(&as->nr_cow_faults);
+	}
+	
+	mm_put_page(mem, old_frame);
+	
+	return 0;
+}
+
+
+/*
+This function caches the translation of vfn found by a lockless walk, its entry at level is in the table at page_table_addr
+The entry is read again under the lock of that table and nothing is inserted if it changed since the walk
+Every path that clears or write protects an entry does it under this lock and flushes the TLB after, so the translation can not outlive the entry
+Must be called under the rcu_read_lock() of the walk, returns false if the walk has to be done again
+*/
+
+static bool tlb_insert_walked(struct mm_physical_memory * mem, uintptr_t vfn, uintptr_t level, uintptr_t page_table_addr, uintptr_t physical_addr, bool write)
+{
+	struct mm_page_frame * table = phys_to_pframe(mem, page_table_addr);
+	uintptr_t pfn = physical_addr >> 12;
+	uintptr_t pte;
+	bool unchanged;
+	
+	if(level == 3)
+	{
+		pfn -= (vfn & 0x01FF);
+	}
+	
+	spin_lock(&table->ptl);
+	
+	pte = READ_ONCE(*get_PTE_address(vfn, level, page_table_addr));
+	unchanged = !table->pt_unlinked && (pte & PTE_VALID) && (pte & PTE_PFN_MASK) == pfn && !(write && (pte & PTE_READ_ONLY));
+	if(unchanged)
+	{
+		mm_tlb_insert(mem->tlb, current->pid, vfn, physical_addr >> 12, write);
+	}
+	
+	spin_unlock(&table->ptl);
+	
+	return unchanged;
+}
+
+
+/*
+This function converts given virtual address to physical address for a read (write == 0) or a write access
+The TLB is checked first, the page tables are only walked on a miss and the result is cached
+The walk runs under rcu_read_lock() without taking any lock, so it never waits behind a page table update or reclaim
+If it finds an invalid entry, or a read only entry on a write, the fault is handled after leaving the read side critical section and the walk is started again
+The result is only cached after the entry is confirmed under its table lock, see tlb_insert_walked()
+Paramters:
+virtual_address : virtual address value
+(* physical_addr) : physical address will be stored in this variable and returned back
+*/
+
+static int translate_address(struct mm_physical_memory * mem, uintptr_t virtual_address, bool write, uintptr_t * physical_addr)
+{
+	struct mm_address_space * as;
+	uintptr_t vfn = virtual_address >> 12;
+	uintptr_t page_table_addr;
+	uintptr_t leaf_table_addr;
+	uintptr_t leaf_level;
+	uintptr_t pfn;
+	
+	int err;
+	
+	if(mm_tlb_lookup(mem->tlb, current->pid, vfn, write, &pfn))
+	{
+		*physical_addr = pfn << 12;
+		return 0;
+	}
+	
+	as = mm_find_address_space(mem, current->pid);
+	if(!as)
+	{
+		return -WRONG_VALUE;
+	}
+	
+	while(1)
+	{
+		err = 0;
+		
+		rcu_read_lock();
+		for(uintptr_t level = get_walk_start(mem, as, vfn, &page_table_addr); level <= 4; level++)
+		{
+			leaf_table_addr = page_table_addr;
+			leaf_level = level;
+			
+			err = walk_level_lockless(mem, vfn, level, page_table_addr, write, &page_table_addr);
+			if(err)
+			{
+				break;
+			}
+			cache_walk_level(mem, as, vfn, level, page_table_addr);
+		}
+		
+		if(!err || err == PAGE_WALK_HUGE)
+		{
+			// An entry cleared after the walk read it must not be cached, or the TLB would keep serving the old frame
+			if(!tlb_insert_walked(mem, vfn, leaf_level, leaf_table_addr, page_table_addr, write))
+			{
+				rcu_read_unlock();
+				continue;
+			}
+			rcu_read_unlock();
+			break;
+		}
+		rcu_read_unlock();
+		
+		if(err == PAGE_WALK_WRITE_PROTECT)
+		{
+			err = do_wp_page(mem, as, vfn);
+			if(err)
+			{
+				return err;
+			}
+			continue;
+		}
+		
+		if(err != PAGE_WALK_FAULT)
+		{
+			return err;
 		}
 		
-		list_for_each_entry_safe(p_frame, temp_p_frame, &mem->alloc_pages, pf_link)
+		struct swap_meta_data meta_data = {
+			.pid = current->pid,
+			.virtual_pframe_addr = vfn << 12,
+		};
+		
+		err = handle_page_fault(mem, PAGE_FAULT_INVALID_PTE, &meta_data);
+		if(err)
 		{
-			if(p_frame->physical_start_address == physical_addr)
-			{
-				list_move_tail(&p_frame->pf_link, &mem->free_pages);
-				mutex_unlock(&mem->mm_memory_mutex);
-				return 0;
-			}
+			printk(KERN_ERR "mm_management : handlepagefault, err:%d\n", err);
+			return err;
 		}
-		
-		printk(KERN_ERR "mm_management : Given page is not available in the pinned list\n");
 	}
 	
-	mutex_unlock(&mem->mm_memory_mutex);
-	return -NO_PAGE_FRAME_AVAILABLE;
+	*physical_addr = page_table_addr;
+	
+	return 0;
 }
 
 
-/*
-This function sets the page table entries
-pfn : 52 bit physical page frame number or physical page frame starting address >> 12
-returns uintptr_t with it reference and validity bit set(i.e., 54 and 53 bits)
-*/
-
-inline uintptr_t set_PTE(uintptr_t pfn)
+int virtual_to_physical_address(struct mm_physical_memory * mem, uintptr_t virtual_address, uintptr_t * physical_addr)
 {
-	return pfn | 0x0030000000000000;
+	return translate_address(mem, virtual_address, 0, physical_addr);
 }
 
 
 /*
-This function sets the page table entries
-pfn : 52 bit physical page frame number or physical page frame starting address >> 12
-returns uintptr_t with it reference and validity bit set(i.e., 54 and 53 bits)
+This function translates virtual_address for a write, a page shared copy-on-write is first copied (or reused if no other PTE maps it any more)
 */
 
-inline uintptr_t set_PTE_Reference_bit(uintptr_t pfn)
+int virtual_to_physical_address_write(struct mm_physical_memory * mem, uintptr_t virtual_address, uintptr_t * physical_addr)
 {
-	return pfn | 0x0020000000000000;
+	return translate_address(mem, virtual_address, 1, physical_addr);
 }
 
 
 /*
-This function requests an page to the kernel
-Returns the starting virtual address of the page frame
+This function walks one level of the page tables without taking any lock, the caller must be in an RCU read side critical section
+or otherwise keep the page table at page_table_addr from being freed
+The entry is read once, so a concurrent update is seen either completely or not at all
+Returns PAGE_WALK_FAULT if the entry is not valid, PAGE_WALK_WRITE_PROTECT if a write found a read only entry
+and PAGE_WALK_HUGE if the level 3 entry is a huge mapping
 */
 
-int get_free_page(struct mm_physical_memory * mem, uintptr_t * addr)
+static int walk_level_lockless(struct mm_physical_memory * mem, uintptr_t vfn, uintptr_t level, uintptr_t page_table_addr, bool write, uintptr_t * next_page_addr)
 {
-	//printk("DEBUG : get_free_page\n");
-	struct mm_page_frame * p_frame = get_free_page_internal(mem, 0);
+	uintptr_t * pte_address = get_PTE_address(vfn, level, page_table_addr);
+	uintptr_t pte = READ_ONCE(*pte_address);
 	
-	if(!p_frame)
+	if( !(pte & PTE_VALID) )
 	{
-		return -1;
-	}
-	int err = update_page_table(mem, latest_virtual_address, p_frame->physical_start_address);
-	if(err)
-	{
-		// Improv : call free_page
-		return -1;
-	}
-	else
-	{
-		p_frame->virtual_start_address = latest_virtual_address;
-		p_frame->pid = current->pid;
-		
-		//printk("DEBUG : p_frame->virtual_start_address:%lx, p_frame->pid:%d\n", p_frame->virtual_start_address, p_frame->pid);
-		
-		(* addr) = latest_virtual_address;
-		latest_virtual_address += (0x01000);
-		return 0;
+		return PAGE_WALK_FAULT;
 	}
-}
-
-
-/*
-This function converts given virtual address to physical address
-Paramters:
-virtual_address : virtual address value
-(* physical_addr) : physical address will be stored in this variable and returned back
-*/
-
-int virtual_to_physical_address(struct mm_physical_memory * mem, uintptr_t virtual_address, uintptr_t * physical_addr)
-{
-	uintptr_t vfn = virtual_address >> 12;
-	uintptr_t page_table_addr;
-	
-	int err;
 	
-	err = get_multilevel_pagetables(vfn, 1, mem->cr3_page_table_addr, &page_table_addr);
-	if(err)
+	if( write && (pte & PTE_READ_ONLY) )
 	{
-		return err;
+		return PAGE_WALK_WRITE_PROTECT;
 	}
 	
-	err = get_multilevel_pagetables(vfn, 2, page_table_addr, &page_table_addr);
-	if(err)
+	// Like the hardware accessed bit, a walk that resolves a page marks its PTE referenced for LRU aging
+	// The bit is only written when it is clear so that walks of a hot page do not keep dirtying its page table line
+	if( (level == 4 || (pte & PTE_HUGE)) && !(pte & PTE_REFERENCE) )
 	{
-		return err;
+		pte_set_referenced(pte_address);
 	}
 	
-	err = get_multilevel_pagetables(vfn, 3, page_table_addr, &page_table_addr);
-	if(err)
+	if(level == 4)
 	{
-		return err;
+		struct mm_page_frame * p_frame = phys_to_pframe(mem, (pte & PTE_PFN_MASK) << 12);
+		
+		// First access to a page brought in by swap readahead
+		if(p_frame->pf_flags & PF_READAHEAD)
+		{
+			swap_ra_hit(mem, p_frame);
+		}
 	}
 	
-	err = get_multilevel_pagetables(vfn, 4, page_table_addr, &page_table_addr);
-	if(err)
+	if(level == 3 && (pte & PTE_HUGE))
 	{
-		return err;
+		*next_page_addr = ((pte & PTE_PFN_MASK) + (vfn & 0x01FF)) << 12;
+		return PAGE_WALK_HUGE;
 	}
 	
-	*physical_addr = page_table_addr;
+	*next_page_addr = (pte & PTE_PFN_MASK) << 12;
 	
 	return 0;
 }
 
+
 /*
 This function gets the page table addresses of the multilevel page tables and at the 4th level gets the physical page address
+An invalid entry is faulted in first, so it may sleep and must not be called under rcu_read_lock()
 Parameters :
 vfn : virtual frame number
 level : page table level (1-4)
 page_table_addr : current page table address
 * next_page_addr : returns next page table address or at the last level returns the physical page address
+Returns PAGE_WALK_HUGE if the level 3 entry is a huge mapping, (* next_page_addr) is then already the physical page address of vfn
 
 */
 
-int get_multilevel_pagetables(uintptr_t vfn, uintptr_t level, uintptr_t page_table_addr, uintptr_t * next_page_addr)
+int get_multilevel_pagetables(struct mm_physical_memory * mem, uintptr_t vfn, uintptr_t level, uintptr_t page_table_addr, uintptr_t * next_page_addr)
 {
 	//printk("DEBUG : get_multilevel_pagetables\n");
-	uintptr_t ind;
-	int err;
-	
-	switch(level)
-	{
-		case 1: ind = (vfn &  0xFF8000000) >> 27; //Extract 27-35 bits of vfn
-			break;
-		
-		case 2: ind = (vfn &  0x07FC0000) >> 18; //Extract 18-26 bits of vfn
-			break;
-			
-		case 3: ind = (vfn &  0x03FE00) >> 9; //Extract 9-17 bits of vfn
-			break;
-			
-		case 4: ind = (vfn &  0x01FF); //Extract 0-8 bits of vfn
-			break;
-	}
+	int err = walk_level_lockless(mem, vfn, level, page_table_addr, 0, next_page_addr);
 	
-	uintptr_t * pte_address = (uintptr_t *)((void *)page_table_addr + ind*4); // get PTE address
-	
-	if( !(*pte_address & 0x010000000000000) ) // Improv :  check if the PTE entry has a valid physical address
+	if(err == PAGE_WALK_FAULT)
 	{
 		struct swap_meta_data meta_data = {
 			.pid = current->pid,
 			.virtual_pframe_addr = vfn << 12,
 		};
 		
-		err = handle_page_fault(PAGE_FAULT_INVALID_PTE, &meta_data);
+		err = handle_page_fault(mem, PAGE_FAULT_INVALID_PTE, &meta_data);
 		if(err)
 		{
 			printk(KERN_ERR "mm_management : handlepagefault, err:%d\n", err);
 			return err;
 		}
+		
+		err = walk_level_lockless(mem, vfn, level, page_table_addr, 0, next_page_addr);
+		if(err == PAGE_WALK_FAULT)
+		{
+			return -WRONG_VALUE;
+		}
 	}
-	*next_page_addr = (*pte_address & 0x000FFFFFFFFFFFFF) << 12;
 	
-	return 0;
+	return err;
 }
 
 
 /*
 This function sets the validity bit of the PTE of the given virtual address to 0(invalid PTE)
+If the address is covered by a huge mapping the level 3 entry of the whole huge page is invalidated
+Nothing is faulted in, -WRONG_VALUE is returned if no valid entry maps the address
 */
 
-int invalidate_PTE(struct mm_physical_memory * mem, uintptr_t virtual_page_address)
+int invalidate_PTE(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t virtual_page_address)
 {
 	int err;
 	uintptr_t page_table_addr;
-	uintptr_t vfn = virtual_page_address >> 12;
+	uintptr_t vfn;
+	uintptr_t level;
+	uintptr_t nr_pages;
 	
-	err = get_multilevel_pagetables(vfn, 1, mem->cr3_page_table_addr, &page_table_addr);
-	if(err)
-	{
-		return err;
-	}
+	// rcu_read_lock() keeps the table from being freed until its lock is taken and pt_unlinked is checked
+	rcu_read_lock();
 	
-	err = get_multilevel_pagetables(vfn, 2, page_table_addr, &page_table_addr);
-	if(err)
+retry:
+	vfn = virtual_page_address >> 12;
+	nr_pages = 1;
+	
+	for(level = get_walk_start(mem, as, vfn, &page_table_addr); level <= 3; level++)
 	{
-		return err;
+		uintptr_t table_addr = page_table_addr;
+		
+		// An invalidation never faults a missing table in, get_multilevel_pagetables() would sleep under rcu_read_lock()
+		err = walk_level_lockless(mem, vfn, level, table_addr, 0, &page_table_addr);
+		if(err == PAGE_WALK_FAULT)
+		{
+			rcu_read_unlock();
+			return -WRONG_VALUE;
+		}
+		if(err == PAGE_WALK_HUGE)
+		{
+			// The whole 2 MiB run is unmapped through its level 3 entry
+			page_table_addr = table_addr;
+			vfn = vfn & ~0x01FFUL;
+			nr_pages = 1UL << HUGE_PAGE_ORDER;
+			break;
+		}
+		cache_walk_level(mem, as, vfn, level, page_table_addr);
 	}
 	
-	err = get_multilevel_pagetables(vfn, 3, page_table_addr, &page_table_addr);
-	if(err)
+	uintptr_t * pte_address = get_PTE_address(vfn, nr_pages == 1 ? 4 : 3, page_table_addr);
+	
+	spin_lock(pte_lockptr(mem, page_table_addr));
+	
+	if(phys_to_pframe(mem, page_table_addr)->pt_unlinked)
 	{
-		return err;
+		spin_unlock(pte_lockptr(mem, page_table_addr));
+		goto retry;
 	}
 	
-	uintptr_t ind = (vfn &  0x01FF);
-	uintptr_t * pte_address = (uintptr_t *)((void *)page_table_addr + ind*4);
+	rcu_read_unlock();
 	
-	if( !(*pte_address & 0x010000000000000) )
+	if( !(*pte_address & PTE_VALID) )
 	{
+		spin_unlock(pte_lockptr(mem, page_table_addr));
 		printk(KERN_ERR "mm_management : Wrong PTE value found while invalidating the PTE\n");
 		return -WRONG_VALUE;
 	}
 	else
 	{
-		*pte_address = *pte_address & 0xFFEFFFFFFFFFFFFF;
+		WRITE_ONCE(*pte_address, *pte_address & ~PTE_VALID);
+		phys_to_pframe(mem, page_table_addr)->pt_nr_used--;
 	}
 	
+	mm_tlb_flush_range(mem->tlb, as->pid, vfn, nr_pages);
+	
+	spin_unlock(pte_lockptr(mem, page_table_addr));
+	
 	printk("mm_management : PAGE_SWAP : INVALIDATED PTE : PTE value: %lx\n", *pte_address);
 	
+	free_empty_page_tables(mem, as, vfn);
+	
 	return 0;
 }
 
 
+/*
+This function invalidates the PTEs of nr_frames isolated order-0 frames, sorted by pid and virtual address, through their reverse mapping
+Consecutive frames of the same pid under the same level 4 page table share one walk and one TLB shootdown of the range they span,
+issued once the table's lock is dropped and before the frames can be freed, and a level 4 page table left empty is freed after that
+Frames whose errs[i] is already set are left mapped, otherwise errs[i] is set to 0 or to the error that left p_frames[i] mapped
+*/
+
+void invalidate_PTE_batch(struct mm_physical_memory * mem, struct mm_page_frame ** p_frames, uintptr_t nr_frames, int * errs)
+{
+	struct mm_address_space * as = NULL;
+	spinlock_t * ptl = NULL;
+	uintptr_t page_table_addr = 0;
+	uintptr_t table_index = 0;
+	uintptr_t flush_start = 0;
+	uintptr_t flush_end = 0; // 0 while nothing under the current table was invalidated
+	bool walked = false;
+	bool emptied = false;
+	int walk_err = 0;
+	
+	for(uintptr_t i = 0; i < nr_frames; i++)
+	{
+		uintptr_t vfn = p_frames[i]->virtual_start_address >> 12;
+		uintptr_t * pte_address;
+		
+		if(errs[i])
+		{
+			continue;
+		}
+		
+		if(!walked || !as || as->pid != p_frames[i]->pid || (vfn >> 9) != table_index)
+		{
+			if(ptl)
+			{
+				spin_unlock(ptl);
+				ptl = NULL;
+			}
+			
+			if(flush_end)
+			{
+				mm_tlb_flush_range(mem->tlb, as->pid, flush_start, flush_end - flush_start);
+				flush_end = 0;
+			}
+			
+			if(emptied)
+			{
+				free_empty_page_tables(mem, as, table_index << 9);
+				emptied = false;
+			}
+			
+			as = mm_find_address_space(mem, p_frames[i]->pid);
+			walk_err = as ? lock_leaf_page_table(mem, as, vfn, &page_table_addr) : -WRONG_VALUE;
+			table_index = vfn >> 9;
+			walked = true;
+			
+			if(!walk_err)
+			{
+				ptl = pte_lockptr(mem, page_table_addr);
+			}
+		}
+		
+		if(walk_err)
+		{
+			errs[i] = walk_err;
+			continue;
+		}
+		
+		pte_address = get_PTE_address(vfn, 4, page_table_addr);
+		
+		if( !(*pte_address & PTE_VALID) || ((*pte_address & PTE_PFN_MASK) << 12) != p_frames[i]->physical_start_address )
+		{
+			// Expected when the page was unmapped after it was isolated
+			if(atomic_read(&p_frames[i]->pf_refcount))
+			{
+				printk(KERN_ERR "mm_management : Wrong PTE value found while invalidating the PTE\n");
+			}
+			errs[i] = -WRONG_VALUE;
+			continue;
+		}
+		
+		// Eviction takes over the only reference, a frame shared copy-on-write or held by a copy in progress stays mapped
+		if(atomic_cmpxchg(&p_frames[i]->pf_refcount, 1, 0) != 1)
+		{
+			errs[i] = -WRONG_VALUE;
+			continue;
+		}
+		atomic_set(&p_frames[i]->pf_mapcount, 0);
+		
+		WRITE_ONCE(*pte_address, *pte_address & ~PTE_VALID);
+		
+		// Victims are sorted by virtual address, so the range only grows upwards
+		if(!flush_end)
+		{
+			flush_start = vfn;
+		}
+		flush_end = vfn + 1;
+		
+		if(!--phys_to_pframe(mem, page_table_addr)->pt_nr_used)
+		{
+			emptied = true;
+		}
+	}
+	
+	if(ptl)
+	{
+		spin_unlock(ptl);
+	}
+	
+	if(flush_end)
+	{
+		mm_tlb_flush_range(mem->tlb, as->pid, flush_start, flush_end - flush_start);
+	}
+	
+	if(emptied)
+	{
+		free_empty_page_tables(mem, as, table_index << 9);
+	}
+}
+
+
 /*
 This function updates the multilevel page tables
+Returns -PAGE_ALREADY_MAPPED if the level 4 entry is already valid
+Caller must hold rcu_read_lock(), which keeps page_table_addr from being freed until its lock is taken and pt_unlinked is checked
+A missing table is allocated with rcu_read_lock() dropped since allocating may reclaim, page_table_addr may be freed meanwhile,
+so PAGE_WALK_RETRY is returned and the walk starts again from the root, the new table is kept in (* new_table) for it
+The caller frees (* new_table) if it is still set once the walk is done
 Paramters :
 vfn : 52 bit virtual page frame number
 level : page table level (1 - 4)
 */
 
-int update_multilevel_pagetables(struct mm_physical_memory * mem, uintptr_t vfn, uintptr_t level, uintptr_t page_table_addr, uintptr_t page_frame_physical_addr, uintptr_t * next_page_addr)
+int update_multilevel_pagetables(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t vfn, uintptr_t level, uintptr_t page_table_addr, uintptr_t page_frame_physical_addr, struct mm_page_frame ** new_table, uintptr_t * next_page_addr)
 {
 	//printk("DEBUG : update_multilevel_pagetables\n");
-	uintptr_t ind;
+	uintptr_t * pte_address = get_PTE_address(vfn, level, page_table_addr);
+	spinlock_t * ptl = pte_lockptr(mem, page_table_addr);
 	
-	switch(level)
+	if(level <= 3 && !*new_table && !(READ_ONCE(*pte_address) & PTE_VALID))
 	{
-		case 1: ind = (vfn &  0xFF8000000) >> 27; //Extract 27-35 bits of vfn
-			break;
+		rcu_read_unlock();
+		*new_table = get_free_page_internal(mem, 1);
+		rcu_read_lock();
 		
-		case 2: ind = (vfn &  0x07FC0000) >> 18; //Extract 18-26 bits of vfn
-			break;
-			
-		case 3: ind = (vfn &  0x03FE00) >> 9; //Extract 9-17 bits of vfn
-			break;
-			
-		case 4: ind = (vfn &  0x01FF); //Extract 0-8 bits of vfn
-			break;
+		if(!*new_table)
+		{
+			return -NO_PAGE_FRAME_AVAILABLE;
+		}
+		
+		memset((void *)(*new_table)->physical_start_address, 0, PAGE_SIZE_EXP);
+		(*new_table)->pt_nr_used = 0;
+		(*new_table)->pt_unlinked = false;
+		
+		// Lockless walks must not see the new table before its zeroed entries
+		smp_wmb();
+		
+		return PAGE_WALK_RETRY;
 	}
 	
-	uintptr_t * pte_address = (uintptr_t *)((void *)page_table_addr + ind*4); // get PTE address
+	spin_lock(ptl);
+	
+	// The table became empty and was unlinked since the walk found it
+	if(phys_to_pframe(mem, page_table_addr)->pt_unlinked)
+	{
+		spin_unlock(ptl);
+		return PAGE_WALK_RETRY;
+	}
 	
-	if( !(*pte_address & 0x010000000000000) ) // check if the PTE entry has a valid physical address
+	if( !(*pte_address & PTE_VALID) ) // check if the PTE entry has a valid physical address
 	{
 		if(level == 1 || level == 2 || level == 3) //
 		{
-			struct mm_page_frame * p_frame = get_free_page_internal(mem, 1);
-			if(!p_frame)
+			// The entry was cleared after it was read above, walk again to allocate the table
+			if(!*new_table)
 			{
-				return -NO_PAGE_FRAME_AVAILABLE;
+				spin_unlock(ptl);
+				return PAGE_WALK_RETRY;
 			}
 			
-			*pte_address = set_PTE( p_frame->physical_start_address >> 12 );
-			
+			WRITE_ONCE(*pte_address, set_PTE( (*new_table)->physical_start_address >> 12 ));
+			*new_table = NULL;
+			atomic_long_inc(&as->nr_page_tables);
 		}
 		else
 		{
-			*pte_address = set_PTE( page_frame_physical_addr >> 12 );
+			WRITE_ONCE(*pte_address, set_PTE( page_frame_physical_addr >> 12 ));
 		}
+		phys_to_pframe(mem, page_table_addr)->pt_nr_used++;
+	}
+	else if(*pte_address & PTE_HUGE)
+	{
+		spin_unlock(ptl);
+		printk(KERN_ERR "mm_management : Virtual address is already covered by a huge page, vfn:%lx\n", vfn);
+		return -WRONG_VALUE;
+	}
+	else if(level == 4)
+	{
+		// Another fault mapped the page first, page_frame_physical_addr is left unmapped for the caller to free
+		spin_unlock(ptl);
+		return -PAGE_ALREADY_MAPPED;
 	}
 	else
 	{
-		*pte_address = set_PTE_Reference_bit(*pte_address);
+		pte_set_referenced(pte_address);
 	}
-	*next_page_addr = (*pte_address & 0x000FFFFFFFFFFFFF) << 12;
+	*next_page_addr = (*pte_address & PTE_PFN_MASK) << 12;
+	
+	spin_unlock(ptl);
 	
 	return 0;
 }
 
 
-int update_page_table(struct mm_physical_memory * mem, uintptr_t virtual_address, uintptr_t page_frame_physical_addr)
+int update_page_table(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t virtual_address, uintptr_t page_frame_physical_addr)
 {
 	//printk("DEBUG : update_page_table\n");
 	uintptr_t vfn = virtual_address >> 12;
 	uintptr_t page_table_addr;
-	int err;
+	struct mm_page_frame * new_table = NULL;
+	int err = 0;
 	
-	//printk("DEBUG : pagetableaddr:%lx\n", mem->cr3_page_table_addr);
-	err = update_multilevel_pagetables(mem, vfn, 1, mem->cr3_page_table_addr, page_frame_physical_addr, &page_table_addr);
-	if(err)
+	rcu_read_lock();
+	
+retry:
+	for(uintptr_t level = get_walk_start(mem, as, vfn, &page_table_addr); level <= 4; level++)
 	{
-		return err;
+		err = update_multilevel_pagetables(mem, as, vfn, level, page_table_addr, page_frame_physical_addr, &new_table, &page_table_addr);
+		if(err == PAGE_WALK_RETRY)
+		{
+			goto retry;
+		}
+		if(err)
+		{
+			break;
+		}
+		cache_walk_level(mem, as, vfn, level, page_table_addr);
 	}
-	//page_table_addr = next_page_table_addr;
 	
-	//printk("DEBUG : pagetableaddr:%lx\n", page_table_addr);
-	err = update_multilevel_pagetables(mem, vfn, 2, page_table_addr, page_frame_physical_addr, &page_table_addr);
-	if(err)
+	rcu_read_unlock();
+	
+	// Another walk installed the table first
+	if(new_table)
 	{
-		return err;
+		free_page_internal(mem, new_table->physical_start_address, 1);
 	}
-	//page_table_addr = next_page_table_addr;
 	
-	//printk("DEBUG : pagetableaddr:%lx\n", page_table_addr);
-	err = update_multilevel_pagetables(mem, vfn, 3, page_table_addr, page_frame_physical_addr, &page_table_addr);
-	if(err)
+	return err;
+	
+}
+
+
+/*
+This function maps the HUGE_PAGE_SIZE_EXP aligned virtual_address to the physically contiguous run at page_frame_physical_addr with a single level 3 entry
+Fails if part of the range is already mapped by 4 KiB pages
+*/
+
+int update_page_table_huge(struct mm_physical_memory * mem, struct mm_address_space * as, uintptr_t virtual_address, uintptr_t page_frame_physical_addr)
+{
+	uintptr_t vfn = virtual_address >> 12;
+	uintptr_t page_table_addr;
+	uintptr_t level;
+	uintptr_t * pte_address;
+	struct mm_page_frame * table;
+	struct mm_page_frame * new_table = NULL;
+	int err = 0;
+	
+	if(virtual_address & (HUGE_PAGE_SIZE_EXP - 1))
 	{
-		return err;
+		printk(KERN_ERR "mm_management : Unaligned address given to update_page_table_huge(), addr:%lx\n", virtual_address);
+		return -INVALID_INPUT;
 	}
-	//page_table_addr = next_page_table_addr;
 	
-	//printk("DEBUG : pagetableaddr:%lx\n", page_table_addr);
-	err = update_multilevel_pagetables(mem, vfn, 4, page_table_addr, page_frame_physical_addr, &page_table_addr);
-	if(err)
+	// rcu_read_lock() keeps the level 3 table from being freed until its lock is taken and pt_unlinked is checked
+	rcu_read_lock();
+	
+retry:
+	level = get_walk_start(mem, as, vfn, &page_table_addr);
+	if(level == 4)
 	{
-		return err;
+		printk(KERN_ERR "mm_management : Virtual address is already mapped by a level 4 page table, addr:%lx\n", virtual_address);
+		err = -WRONG_VALUE;
+		goto out;
 	}
 	
-	return 0;
+	for(; level <= 2; level++)
+	{
+		err = update_multilevel_pagetables(mem, as, vfn, level, page_table_addr, page_frame_physical_addr, &new_table, &page_table_addr);
+		if(err == PAGE_WALK_RETRY)
+		{
+			goto retry;
+		}
+		if(err)
+		{
+			goto out;
+		}
+		cache_walk_level(mem, as, vfn, level, page_table_addr);
+	}
+	
+	pte_address = get_PTE_address(vfn, 3, page_table_addr);
+	table = phys_to_pframe(mem, page_table_addr);
+	
+	spin_lock(&table->ptl);
+	
+	if(table->pt_unlinked)
+	{
+		spin_unlock(&table->ptl);
+		goto retry;
+	}
+	
+	if( (*pte_address & PTE_VALID) && !(*pte_address & PTE_HUGE) )
+	{
+		spin_unlock(&table->ptl);
+		printk(KERN_ERR "mm_management : Virtual address is already mapped by a level 4 page table, addr:%lx\n", virtual_address);
+		err = -WRONG_VALUE;
+		goto out;
+	}
+	
+	if( !(*pte_address & PTE_VALID) )
+	{
+		table->pt_nr_used++;
+	}
+	WRITE_ONCE(*pte_address, set_PTE( page_frame_physical_addr >> 12 ) | PTE_HUGE);
+	
+	spin_unlock(&table->ptl);
+	
+out:
+	rcu_read_unlock();
+	
+	// Another walk installed the table first
+	if(new_table)
+	{
+		free_page_internal(mem, new_table->physical_start_address, 1);
+	}
 	
+	return err;
 }
 
 
 int mm_free_page(struct mm_physical_memory * mem, uintptr_t virtual_addr)
 {
 	int err;
+	int munmap_err;
 	
 	uintptr_t physical_addr;
+	struct mm_address_space * as;
+	struct mm_page_frame * p_frame;
+	uintptr_t nr_pages;
+	bool huge;
+	bool allocated;
 	
 	err = virtual_to_physical_address(mem, virtual_addr, &physical_addr);
 	if(err)
@@ -473,18 +2141,47 @@ int mm_free_page(struct mm_physical_memory * mem, uintptr_t virtual_addr)
 		return err;
 	}
 	
-	err = invalidate_PTE(mem, virtual_addr);
-	if(err)
+	// The translation above created nothing, the address space of current exists
+	as = mm_find_address_space(mem, current->pid);
+	p_frame = phys_to_pframe(mem, physical_addr);
+	
+	// A huge page can only be freed through its first address
+	// PF_ALLOCATED does not tell, reclaim clears it on a frame it has isolated
+	huge = range_has_huge_mapping(mem, as, virtual_addr >> 12, 1);
+	if(huge && (virtual_addr & (HUGE_PAGE_SIZE_EXP - 1)))
 	{
-		return err;
+		printk(KERN_ERR "mm_management : Address does not start an allocation, addr:%lx\n", virtual_addr);
+		return -INVALID_INPUT;
 	}
 	
-	err = free_page_internal(mem, physical_addr , 0);
+	err = invalidate_PTE(mem, as, virtual_addr);
 	if(err)
 	{
 		return err;
 	}
-	return 0;
+	
+	nr_pages = huge ? (1UL << HUGE_PAGE_ORDER) : 1;
+	atomic_long_sub(nr_pages, &as->nr_mapped_pages);
+	
+	// A frame shared copy-on-write stays allocated for its other mappers
+	atomic_dec(&p_frame->pf_mapcount);
+	if(atomic_dec_and_test(&p_frame->pf_refcount))
+	{
+		spin_lock(&mem->alloc_lists_lock);
+		allocated = p_frame->pf_flags & PF_ALLOCATED;
+		spin_unlock(&mem->alloc_lists_lock);
+		
+		// A frame reclaim has isolated is freed by swap_page() once it finds the last reference gone, as in mm_unmap_range_as()
+		if(allocated)
+		{
+			err = free_page_internal(mem, physical_addr , 0);
+		}
+	}
+	
+	// The PTE is gone, so the range is released whatever became of the frame
+	munmap_err = mm_munmap(as, virtual_addr, nr_pages);
+	
+	return err ? err : munmap_err;
 }
 
 
@@ -0,0 +1,116 @@
+#include "../include/mm_pwc.h"
+
+/*
+This function allocates the paging-structure cache of mem
+*/
+
+int mm_pwc_init(struct mm_physical_memory * mem)
+{
+	struct mm_pwc * pwc = kzalloc( sizeof(struct mm_pwc), GFP_KERNEL);
+	if(!pwc)
+	{
+		printk(KERN_ERR "mm_management : Error allocating struct mm_pwc\n");
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	spin_lock_init(&pwc->lock);
+	atomic64_set(&pwc->hits, 0);
+	atomic64_set(&pwc->misses, 0);
+	
+	mem->pwc = pwc;
+	return 0;
+}
+
+
+void mm_pwc_uninit(struct mm_physical_memory * mem)
+{
+	kfree(mem->pwc);
+	mem->pwc = NULL;
+}
+
+
+static inline uintptr_t pwc_tag(uintptr_t vfn, int cache)
+{
+	return cache == MM_PWC_LEVEL4 ? vfn >> 9 : vfn >> 18;
+}
+
+
+/*
+This function looks for a cached upper level of the walk of vfn from root, the longest match (level 4 table) is tried first
+Returns true and stores the page table address and its level (3 or 4) on a hit
+*/
+
+bool mm_pwc_lookup(struct mm_pwc * pwc, uintptr_t root, uintptr_t vfn, uintptr_t * page_table_addr, uintptr_t * level)
+{
+	bool hit = false;
+	
+	spin_lock(&pwc->lock);
+	for(int cache = MM_PWC_LEVEL4; cache >= MM_PWC_LEVEL3; cache--)
+	{
+		uintptr_t tag = pwc_tag(vfn, cache);
+		struct mm_pwc_entry * entry = &pwc->entries[cache][tag & (MM_PWC_ENTRIES - 1)];
+		
+		if(entry->valid && entry->tag == tag && entry->root == root)
+		{
+			*page_table_addr = entry->page_table_addr;
+			*level = cache == MM_PWC_LEVEL4 ? 4 : 3;
+			hit = true;
+			break;
+		}
+	}
+	spin_unlock(&pwc->lock);
+	
+	if(hit)
+	{
+		atomic64_inc(&pwc->hits);
+	}
+	else
+	{
+		atomic64_inc(&pwc->misses);
+	}
+	
+	return hit;
+}
+
+
+/*
+This function caches the level 3 or level 4 page table reached while walking vfn from root
+*/
+
+void mm_pwc_insert(struct mm_pwc * pwc, uintptr_t root, uintptr_t vfn, uintptr_t level, uintptr_t page_table_addr)
+{
+	int cache = level == 4 ? MM_PWC_LEVEL4 : MM_PWC_LEVEL3;
+	uintptr_t tag = pwc_tag(vfn, cache);
+	struct mm_pwc_entry * entry = &pwc->entries[cache][tag & (MM_PWC_ENTRIES - 1)];
+	
+	spin_lock(&pwc->lock);
+	entry->root = root;
+	entry->tag = tag;
+	entry->page_table_addr = page_table_addr;
+	entry->valid = true;
+	spin_unlock(&pwc->lock);
+}
+
+
+/*
+This function drops every cached page table, it must be called whenever a page table page is freed
+*/
+
+void mm_pwc_flush_all(struct mm_pwc * pwc)
+{
+	spin_lock(&pwc->lock);
+	for(int cache = MM_PWC_LEVEL3; cache <= MM_PWC_LEVEL4; cache++)
+	{
+		for(int i = 0; i < MM_PWC_ENTRIES; i++)
+		{
+			pwc->entries[cache][i].valid = false;
+		}
+	}
+	spin_unlock(&pwc->lock);
+}
+
+
+void mm_pwc_print_stats(struct mm_pwc * pwc)
+{
+	printk("mm_management : PWC : hits:%lld, misses:%lld\n", (long long)atomic64_read(&pwc->hits), (long long)atomic64_read(&pwc->misses));
+}
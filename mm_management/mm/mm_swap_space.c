@@ -1,14 +1,339 @@
+#include <linux/bitmap.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/log2.h>
 #include "../include/mm_swap_space.h"
+#include "../include/mm_lru.h"
+#include "../include/mm_zswap.h"
+#include "../include/mm_address_space.h"
 
 struct swap_space * swap_sp = NULL;
 
-void initialise_swap_space(void)
+/*
+This function sets up the swap device: nr_slots page sized slots, their swap block descriptors and the slot bitmap are all allocated here
+so that swapping a page out never has to allocate memory
+ra_max_pages limits the swap readahead window and is rounded down to a power of two, 0 or 1 disables readahead
+*/
+
+int initialise_swap_space(uintptr_t nr_slots, unsigned int ra_max_pages)
 {
-	swap_sp = kmalloc( sizeof(struct swap_space), GFP_KERNEL);
+	swap_sp = kzalloc( sizeof(struct swap_space), GFP_KERNEL);
+	if(!swap_sp)
+	{
+		printk(KERN_ERR "mm_management : Error allocating struct swap_space\n");
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	swap_sp->slots_data = vmalloc(nr_slots * PAGE_SIZE_EXP);
+	swap_sp->blocks = kvcalloc(nr_slots, sizeof(struct swap_block), GFP_KERNEL);
+	swap_sp->slot_bitmap = bitmap_zalloc(nr_slots, GFP_KERNEL);
+	if(!swap_sp->slots_data || !swap_sp->blocks || !swap_sp->slot_bitmap)
+	{
+		printk(KERN_ERR "mm_management : Error allocating %lu swap slots\n", nr_slots);
+		uninitialise_swap_space();
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	for(uintptr_t slot = 0; slot < nr_slots; slot++)
+	{
+		swap_sp->blocks[slot].data = swap_sp->slots_data + slot * PAGE_SIZE_EXP;
+		INIT_LIST_HEAD(&swap_sp->blocks[slot].ss_link);
+		INIT_HLIST_NODE(&swap_sp->blocks[slot].ss_hash_link);
+	}
+	
+	swap_sp->nr_slots = nr_slots;
+	swap_sp->nr_used_slots = 0;
+	swap_sp->next_slot = 0;
+	
+	swap_sp->ra_max_pages = ra_max_pages ? rounddown_pow_of_two(min_t(unsigned int, ra_max_pages, MM_SWAP_RA_MAX_PAGES)) : 1;
+	swap_sp->ra_prev_win = 1;
+	swap_sp->ra_prev_addr = 0;
+	atomic_set(&swap_sp->ra_hits, 0);
+	atomic64_set(&swap_sp->ra_pages, 0);
+	atomic64_set(&swap_sp->ra_hits_total, 0);
+	
 	INIT_LIST_HEAD(&swap_sp->swap_blocks);
+	hash_init(swap_sp->swap_hash);
 	mutex_init(&swap_sp->swap_space_mutex);
+	
+	swap_sp->sf_cache = kmem_cache_create("mm_swap_same_filled", sizeof(struct swap_sf_entry), 0, 0, NULL);
+	if(!swap_sp->sf_cache)
+	{
+		printk(KERN_ERR "mm_management : Error creating the same filled swap entry cache\n");
+		uninitialise_swap_space();
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	hash_init(swap_sp->sf_hash);
+	swap_sp->nr_same_filled = 0;
+	swap_sp->nr_same_filled_total = 0;
+	
+	return 0;
+}
+
+
+void uninitialise_swap_space(void)
+{
+	struct swap_sf_entry * sf_entry;
+	struct hlist_node * temp;
+	int bkt;
+	
+	if(!swap_sp)
+	{
+		return;
+	}
+	
+	if(swap_sp->sf_cache)
+	{
+		hash_for_each_safe(swap_sp->sf_hash, bkt, temp, sf_entry, sf_hash_link)
+		{
+			hash_del(&sf_entry->sf_hash_link);
+			kmem_cache_free(swap_sp->sf_cache, sf_entry);
+		}
+		kmem_cache_destroy(swap_sp->sf_cache);
+	}
+	
+	bitmap_free(swap_sp->slot_bitmap);
+	kvfree(swap_sp->blocks);
+	vfree(swap_sp->slots_data);
+	kfree(swap_sp);
+	swap_sp = NULL;
+}
+
+
+/*
+This function takes a free slot, searching the bitmap from where the previous search stopped
+Caller must hold swap_space_mutex
+Returns the swap block of the slot or NULL if swap space is full
+*/
+
+static struct swap_block * swap_slot_alloc_locked(void)
+{
+	unsigned long slot = find_next_zero_bit(swap_sp->slot_bitmap, swap_sp->nr_slots, swap_sp->next_slot);
+	
+	if(slot >= swap_sp->nr_slots)
+	{
+		slot = find_first_zero_bit(swap_sp->slot_bitmap, swap_sp->nr_slots);
+		if(slot >= swap_sp->nr_slots)
+		{
+			return NULL;
+		}
+	}
+	
+	__set_bit(slot, swap_sp->slot_bitmap);
+	swap_sp->nr_used_slots++;
+	swap_sp->next_slot = slot + 1;
+	
+	return &swap_sp->blocks[slot];
+}
+
+
+/*
+This function takes nr_slots adjacent free slots so that pages evicted together are stored together
+Caller must hold swap_space_mutex
+Returns the swap block of the first slot or NULL if there is no free run that long
+*/
+
+static struct swap_block * swap_slot_alloc_range_locked(uintptr_t nr_slots)
+{
+	unsigned long slot = bitmap_find_next_zero_area(swap_sp->slot_bitmap, swap_sp->nr_slots, swap_sp->next_slot, nr_slots, 0);
+	
+	if(slot >= swap_sp->nr_slots)
+	{
+		slot = bitmap_find_next_zero_area(swap_sp->slot_bitmap, swap_sp->nr_slots, 0, nr_slots, 0);
+		if(slot >= swap_sp->nr_slots)
+		{
+			return NULL;
+		}
+	}
+	
+	bitmap_set(swap_sp->slot_bitmap, slot, nr_slots);
+	swap_sp->nr_used_slots += nr_slots;
+	swap_sp->next_slot = slot + nr_slots;
+	
+	return &swap_sp->blocks[slot];
+}
+
+
+static void swap_slot_free_locked(struct swap_block * s_block)
+{
+	__clear_bit(s_block - swap_sp->blocks, swap_sp->slot_bitmap);
+	swap_sp->nr_used_slots--;
+}
+
+
+static void swap_block_insert_locked(struct swap_block * s_block)
+{
+	list_add_tail(&s_block->ss_link, &swap_sp->swap_blocks);
+	hash_add(swap_sp->swap_hash, &s_block->ss_hash_link, swap_key(s_block->pid, s_block->virtual_pframe_addr));
+}
+
+
+/*
+This function finds the swap block of (pid, virtual_pframe_addr) in the swap hash
+Caller must hold swap_space_mutex
+*/
+
+static struct swap_block * swap_block_lookup_locked(pid_t pid, uintptr_t virtual_pframe_addr)
+{
+	struct swap_block * s_block;
+	
+	hash_for_each_possible(swap_sp->swap_hash, s_block, ss_hash_link, swap_key(pid, virtual_pframe_addr))
+	{
+		if(s_block->pid == pid && s_block->virtual_pframe_addr == virtual_pframe_addr)
+		{
+			return s_block;
+		}
+	}
+	
+	return NULL;
+}
+
+
+/*
+This function finds the swap block of (pid, virtual_pframe_addr) in the swap hash and takes it out of swap space
+Caller must hold swap_space_mutex
+*/
+
+static struct swap_block * swap_block_remove_locked(pid_t pid, uintptr_t virtual_pframe_addr)
+{
+	struct swap_block * s_block = swap_block_lookup_locked(pid, virtual_pframe_addr);
+	
+	if(s_block)
+	{
+		hash_del(&s_block->ss_hash_link);
+		list_del(&s_block->ss_link);
+	}
+	
+	return s_block;
+}
+
+
+/*
+This function checks whether every word of the page holds the same value and returns it in (* value)
+*/
+
+static bool swap_page_same_filled(const void * page, unsigned long * value)
+{
+	const unsigned long * words = page;
+	const uintptr_t last = PAGE_SIZE_EXP / sizeof(unsigned long) - 1;
+	unsigned long val = words[0];
+	
+	// Most pages that are not same filled already differ between their first and last word
+	if(val != words[last])
+	{
+		return false;
+	}
+	
+	// A repeated byte, zero above all, is checked by memchr_inv(), which compares a word at a time
+	if(val == (val & 0xFF) * (~0UL / 0xFF))
+	{
+		if(memchr_inv(page, val & 0xFF, PAGE_SIZE_EXP))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		for(uintptr_t pos = 1; pos < last; pos++)
+		{
+			if(words[pos] != val)
+			{
+				return false;
+			}
+		}
+	}
+	
+	*value = val;
+	return true;
+}
+
+
+/*
+This function keeps the page of (pid, virtual_pframe_addr) as its fill value if it is same filled
+Caller must hold swap_space_mutex
+Returns -WRONG_VALUE if the page is not same filled or the entry could not be allocated, the page is then stored some other way
+*/
+
+static int swap_sf_store_locked(pid_t pid, uintptr_t virtual_pframe_addr, const void * page)
+{
+	struct swap_sf_entry * sf_entry;
+	unsigned long value;
+	
+	if(!swap_page_same_filled(page, &value))
+	{
+		return -WRONG_VALUE;
+	}
+	
+	// Reclaim must not recurse into the allocator
+	sf_entry = kmem_cache_alloc(swap_sp->sf_cache, GFP_NOWAIT);
+	if(!sf_entry)
+	{
+		return -WRONG_VALUE;
+	}
+	
+	sf_entry->pid = pid;
+	sf_entry->virtual_pframe_addr = virtual_pframe_addr;
+	sf_entry->value = value;
+	hash_add(swap_sp->sf_hash, &sf_entry->sf_hash_link, swap_key(pid, virtual_pframe_addr));
+	
+	swap_sp->nr_same_filled++;
+	swap_sp->nr_same_filled_total++;
+	
+	return 0;
+}
+
+
+static struct swap_sf_entry * swap_sf_lookup_locked(pid_t pid, uintptr_t virtual_pframe_addr)
+{
+	struct swap_sf_entry * sf_entry;
+	
+	hash_for_each_possible(swap_sp->sf_hash, sf_entry, sf_hash_link, swap_key(pid, virtual_pframe_addr))
+	{
+		if(sf_entry->pid == pid && sf_entry->virtual_pframe_addr == virtual_pframe_addr)
+		{
+			return sf_entry;
+		}
+	}
+	
+	return NULL;
+}
+
+
+/*
+This function drops the same filled entry of (pid, virtual_pframe_addr) if there is one
+Caller must hold swap_space_mutex
+Returns -SWAP_SPACE_ERROR if there is none, otherwise the fill value in (* value)
+*/
+
+static int swap_sf_remove_locked(pid_t pid, uintptr_t virtual_pframe_addr, unsigned long * value)
+{
+	struct swap_sf_entry * sf_entry = swap_sf_lookup_locked(pid, virtual_pframe_addr);
+	
+	if(!sf_entry)
+	{
+		return -SWAP_SPACE_ERROR;
+	}
+	
+	*value = sf_entry->value;
+	hash_del(&sf_entry->sf_hash_link);
+	kmem_cache_free(swap_sp->sf_cache, sf_entry);
+	swap_sp->nr_same_filled--;
+	
+	return 0;
+}
+
+
+/*
+Returns true if swap space holds no page in any form
+Caller must hold swap_space_mutex
+*/
+
+static bool swap_space_empty_locked(void)
+{
+	return !swap_sp->nr_used_slots && !swap_sp->nr_same_filled && !(zswap && zswap->nr_stored);
 }
 
+
 void print_swap_space(void)
 {
 	struct list_head *pos;
@@ -27,72 +352,207 @@ void print_swap_space(void)
 
 
 /*
-This function moves the allocated page into free page list and copies the data in the allocated page into space
+This function puts an isolated victim back on the allocated list and the LRU after a failed eviction
+A victim whose last reference was dropped while it was isolated, for example by mm_unmap_range(), was not freed since it was off the allocated list,
+so it is handed to the caller instead
+Returns false if the caller has to free the frame
 */
 
-int swap_page(struct mm_physical_memory * mem)
+static bool swap_putback_victim(struct mm_physical_memory * mem, struct mm_page_frame * p_frame)
 {
-	struct swap_block * swap_block = kmalloc( sizeof(struct swap_block), GFP_KERNEL);
-	if(!swap_block)
+	spin_lock(&mem->alloc_lists_lock);
+	
+	// References are only dropped to zero before the frame is looked for on the allocated list under alloc_lists_lock
+	if(!atomic_read(&p_frame->pf_refcount))
 	{
-		printk(KERN_ERR "mm_management : Error allocating struct swap_block\n");
-		return -ERROR_ALLOCATING_MEMORY;
+		spin_unlock(&mem->alloc_lists_lock);
+		return false;
 	}
 	
-	while(1)
+	list_add(&p_frame->pf_link, &mem->alloc_pages);
+	mem->nr_alloc_pages++;
+	p_frame->pf_flags = p_frame->pf_flags | PF_ALLOCATED;
+	spin_lock(&mem->lru_lock);
+	lru_add_locked(mem, p_frame);
+	spin_unlock(&mem->lru_lock);
+	spin_unlock(&mem->alloc_lists_lock);
+	
+	return true;
+}
+
+
+void print_swap_stats(void)
+{
+	printk("mm_management : SWAP : used slots:%lu of %lu, readahead window:%u (max %u), readahead pages:%lld, readahead hits:%lld\n",
+		swap_sp->nr_used_slots, swap_sp->nr_slots, swap_sp->ra_prev_win, swap_sp->ra_max_pages,
+		(long long)atomic64_read(&swap_sp->ra_pages), (long long)atomic64_read(&swap_sp->ra_hits_total));
+	printk("mm_management : SWAP : same filled pages:%lu, same filled pages swapped out:%lu\n", swap_sp->nr_same_filled, swap_sp->nr_same_filled_total);
+}
+
+
+static int victim_cmp(const void * a, const void * b)
+{
+	const struct mm_page_frame * frame_a = *(const struct mm_page_frame **)a;
+	const struct mm_page_frame * frame_b = *(const struct mm_page_frame **)b;
+	
+	if(frame_a->pid != frame_b->pid)
 	{
-		if( mutex_trylock(&mem->mm_memory_mutex) )
-		{
-			if( mutex_trylock(&swap_sp->swap_space_mutex) )
-			{
-				break;
-			}
-			mutex_unlock(&mem->mm_memory_mutex);
-		}
-		
-		// Improve : Try adding sleeping mechanism or yeild the CPU
+		return frame_a->pid < frame_b->pid ? -1 : 1;
 	}
 	
-	list_add_tail(&swap_block->ss_link, &swap_sp->swap_blocks);
+	if(frame_a->virtual_start_address != frame_b->virtual_start_address)
+	{
+		return frame_a->virtual_start_address < frame_b->virtual_start_address ? -1 : 1;
+	}
 	
-	if(list_empty(&mem->alloc_pages))
+	return 0;
+}
+
+
+/*
+This function evicts up to nr_pages of the coldest allocated pages chosen by the LRU, copies their data into swap space and moves their frames to the free lists
+The victims are isolated under one acquisition of alloc_lists_lock and lru_lock and sorted by pid and virtual address, so neighbouring pages share a page table walk
+when their PTEs are invalidated and the pages that need a swap slot get adjacent slots
+A page whose words all hold the same value only keeps that value, any other page is kept in the compressed tier when it is enabled
+and compresses well enough, and takes a swap slot otherwise
+Direct reclaim frees the frames to the current cpu's list for the allocation that is waiting on them,
+kswapd gives them back to the buddy allocator so they count towards the watermarks
+Returns the number of pages evicted or an error if none could be
+*/
+
+int swap_page(struct mm_physical_memory * mem, uintptr_t nr_pages, bool direct_reclaim)
+{
+	struct mm_page_frame * victims[MM_SWAP_CLUSTER];
+	struct swap_block * swap_blocks[MM_SWAP_CLUSTER];
+	int errs[MM_SWAP_CLUSTER];
+	bool compressed[MM_SWAP_CLUSTER];
+	bool same_filled[MM_SWAP_CLUSTER];
+	unsigned long value;
+	struct swap_block * slot_run;
+	uintptr_t nr_victims;
+	uintptr_t nr_need_slot = 0;
+	uintptr_t nr_evicted = 0;
+	LIST_HEAD(evicted);
+	
+	nr_pages = min_t(uintptr_t, nr_pages, MM_SWAP_CLUSTER);
+	
+	mutex_lock(&swap_sp->swap_space_mutex);
+	
+	// Isolate the victims so they can be copied and unmapped without holding alloc_lists_lock or lru_lock
+	nr_victims = mm_lru_isolate_victims(mem, victims, nr_pages);
+	
+	if(!nr_victims)
 	{
 		mutex_unlock(&swap_sp->swap_space_mutex);
-		mutex_unlock(&mem->mm_memory_mutex);
-		printk(KERN_ERR "mm_management : No page frames available in the memory\n");
+		printk(KERN_ERR "mm_management : No page frames available to swap\n");
 		return -NO_PAGE_FRAME_AVAILABLE;
 	}
 	
-	struct mm_page_frame * p_frame = list_first_entry(&mem->alloc_pages, struct mm_page_frame, pf_link);
-	
-	swap_block->virtual_pframe_addr = p_frame->virtual_start_address;
-	swap_block->pid = p_frame->pid;
-	swap_block->data = kmalloc( PAGE_SIZE_EXP, GFP_KERNEL);
+	sort(victims, nr_victims, sizeof(struct mm_page_frame *), victim_cmp, NULL);
 	
-	memcpy(swap_block->data, (void *)p_frame->physical_start_address, PAGE_SIZE_EXP);
+	for(uintptr_t i = 0; i < nr_victims; i++)
+	{
+		swap_blocks[i] = NULL;
+		errs[i] = 0;
+		same_filled[i] = !swap_sf_store_locked(victims[i]->pid, victims[i]->virtual_start_address, (void *)victims[i]->physical_start_address);
+		compressed[i] = !same_filled[i] && zswap && !mm_zswap_store_locked(victims[i]->pid, victims[i]->virtual_start_address, (void *)victims[i]->physical_start_address);
+		
+		if(!same_filled[i] && !compressed[i])
+		{
+			nr_need_slot++;
+		}
+	}
 	
-	int err = invalidate_PTE(mem, p_frame->virtual_start_address);
+	slot_run = nr_need_slot ? swap_slot_alloc_range_locked(nr_need_slot) : NULL;
 	
-	if(err)
+	for(uintptr_t i = 0; i < nr_victims; i++)
 	{
-		mutex_unlock(&swap_sp->swap_space_mutex);
-		mutex_unlock(&mem->mm_memory_mutex);
-		return err;
+		if(same_filled[i] || compressed[i])
+		{
+			continue;
+		}
+		
+		swap_blocks[i] = slot_run ? slot_run++ : swap_slot_alloc_locked();
+		if(!swap_blocks[i])
+		{
+			printk(KERN_ERR "mm_management : Swap space is full\n");
+			errs[i] = -SWAP_SPACE_ERROR;
+			continue;
+		}
+		
+		swap_blocks[i]->virtual_pframe_addr = victims[i]->virtual_start_address;
+		swap_blocks[i]->pid = victims[i]->pid;
+		
+		memcpy(swap_blocks[i]->data, (void *)victims[i]->physical_start_address, PAGE_SIZE_EXP);
 	}
 	
-	list_move_tail(&p_frame->pf_link, &mem->free_pages);
+	invalidate_PTE_batch(mem, victims, nr_victims, errs);
+	
+	for(uintptr_t i = 0; i < nr_victims; i++)
+	{
+		if(errs[i])
+		{
+			// The frame is no longer mapped anywhere, it is freed without keeping its contents
+			if(!swap_putback_victim(mem, victims[i]))
+			{
+				list_add_tail(&victims[i]->pf_link, &evicted);
+				nr_evicted++;
+			}
+			
+			if(swap_blocks[i])
+			{
+				swap_slot_free_locked(swap_blocks[i]);
+			}
+			else if(same_filled[i])
+			{
+				swap_sf_remove_locked(victims[i]->pid, victims[i]->virtual_start_address, &value);
+			}
+			else if(compressed[i])
+			{
+				mm_zswap_drop_locked(victims[i]->pid, victims[i]->virtual_start_address);
+			}
+			continue;
+		}
+		
+		if(swap_blocks[i])
+		{
+			swap_block_insert_locked(swap_blocks[i]);
+		}
+		
+		list_add_tail(&victims[i]->pf_link, &evicted);
+		nr_evicted++;
+		
+		// The PTE was found through the address space of the pid, so it exists
+		atomic_long_dec(&mm_find_address_space(mem, victims[i]->pid)->nr_mapped_pages);
+		
+		printk("mm_management : PAGE_SWAP : Page frame addr:%lx\n", victims[i]->physical_start_address);
+	}
 	
 	mutex_unlock(&swap_sp->swap_space_mutex);
-	mutex_unlock(&mem->mm_memory_mutex);
 	
-	printk("mm_management : PAGE_SWAP : Page frame addr:%lx\n", p_frame->physical_start_address);
+	if(direct_reclaim)
+	{
+		struct mm_page_frame *p_frame, *temp_p_frame;
+		
+		list_for_each_entry_safe(p_frame, temp_p_frame, &evicted, pf_link)
+		{
+			list_del_init(&p_frame->pf_link);
+			free_pcp_page(mem, p_frame, 1);
+		}
+	}
+	else
+	{
+		free_pages_bulk(mem, &evicted);
+	}
 	
-	return 0;
+	return nr_evicted ? nr_evicted : -SWAP_SPACE_ERROR;
 }
 
 
 /*
 This page handles page_fault when the pages are not available
+For PAGE_FAULT_NO_PAGE data points to the number of frames the waiting allocation needs, direct reclaim evicts only that many (at most MM_SWAP_CLUSTER)
+and leaves reclaiming up to the high watermark to kswapd
 */
 
 int handle_page_fault(struct mm_physical_memory * mem, int cmd, void * data)
@@ -101,14 +561,19 @@ int handle_page_fault(struct mm_physical_memory * mem, int cmd, void * data)
 	
 	switch(cmd)
 	{
-		case PAGE_FAULT_NO_PAGE:	err = swap_page(mem);
-						if(err)
+		case PAGE_FAULT_NO_PAGE:	err = swap_page(mem, data ? *(uintptr_t *)data : 1, true);
+						if(err < 0)
 						{
 							return err;
 						}
 						break;
 						
 		case PAGE_FAULT_INVALID_PTE :	err = get_swap_space_data(mem, data);
+						// Not in swap space, it may be a lazily reserved page touched for the first time
+						if(err == -SWAP_SPACE_ERROR)
+						{
+							err = mm_demand_page_fault(mem, ((struct swap_meta_data *)data)->pid, ((struct swap_meta_data *)data)->virtual_pframe_addr);
+						}
 						if(err)
 						{
 							return err;
@@ -120,49 +585,357 @@ int handle_page_fault(struct mm_physical_memory * mem, int cmd, void * data)
 }
 
 
-int get_swap_space_data(struct mm_physical_memory * mem, void * meta_data)
+/*
+This function drops whatever swap space holds for the page of (pid, virtual_pframe_addr)
+Caller must hold swap_space_mutex
+*/
+
+static void swap_drop_locked(pid_t pid, uintptr_t virtual_pframe_addr)
 {
-	struct swap_meta_data * m_data = (struct swap_meta_data *)meta_data;
-	struct swap_block *s_block, *temp;
-	struct mm_page_frame * p_frame;
+	struct swap_block * s_block;
+	unsigned long value;
+	
+	if( (s_block = swap_block_remove_locked(pid, virtual_pframe_addr)) )
+	{
+		swap_slot_free_locked(s_block);
+	}
 	
-	printk("DEBUG : m_data->pid:%d, m_data->virtual_pframe_addr:%lx\n", m_data->pid, m_data->virtual_pframe_addr);
+	swap_sf_remove_locked(pid, virtual_pframe_addr, &value);
 	
-	list_for_each_entry_safe(s_block, temp, &swap_sp->swap_blocks, ss_link)
+	if(zswap)
 	{
-		if(s_block->pid == m_data->pid && s_block->virtual_pframe_addr == m_data->virtual_pframe_addr )
+		mm_zswap_drop_locked(pid, virtual_pframe_addr);
+	}
+}
+
+
+/*
+This function copies the page swap space holds for (pid, virtual_pframe_addr) into dst and leaves it stored
+With dst NULL it only checks that the page is there
+Caller must hold swap_space_mutex
+Returns -SWAP_SPACE_ERROR if the page is not in swap space
+*/
+
+static int swap_read_locked(pid_t pid, uintptr_t virtual_pframe_addr, void * dst)
+{
+	struct swap_sf_entry * sf_entry;
+	struct zswap_entry * z_entry;
+	struct swap_block * s_block;
+	
+	if( (sf_entry = swap_sf_lookup_locked(pid, virtual_pframe_addr)) )
+	{
+		if(dst)
 		{
-			p_frame = get_free_page_internal(mem, 0);
-			
-			int err = update_page_table(mem, m_data->virtual_pframe_addr, p_frame->physical_start_address);
+			memset_l((unsigned long *)dst, sf_entry->value, PAGE_SIZE_EXP / sizeof(unsigned long));
+		}
+		return 0;
+	}
+	
+	if( zswap && (z_entry = mm_zswap_lookup_locked(pid, virtual_pframe_addr)) )
+	{
+		// A copy that does not decompress must not look like a page that was never swapped out
+		if(dst && mm_zswap_load(z_entry, dst))
+		{
+			return -WRONG_VALUE;
+		}
+		return 0;
+	}
+	
+	if( (s_block = swap_block_lookup_locked(pid, virtual_pframe_addr)) )
+	{
+		if(dst)
+		{
+			memcpy(dst, s_block->data, PAGE_SIZE_EXP);
+		}
+		return 0;
+	}
+	
+	return -SWAP_SPACE_ERROR;
+}
+
+
+/*
+This function drops whatever swap space holds for the nr_pages pages of pid from virtual_addr once the range is unmapped
+Otherwise a later reservation of the same addresses could be handed the stale data on a fault
+*/
+
+void swap_discard_range(pid_t pid, uintptr_t virtual_addr, uintptr_t nr_pages)
+{
+	mutex_lock(&swap_sp->swap_space_mutex);
+	
+	for(uintptr_t i = 0; i < nr_pages; i++)
+	{
+		// Nothing is left to look for
+		if(swap_space_empty_locked())
+		{
+			break;
+		}
+		
+		swap_drop_locked(pid, virtual_addr + (i << 12));
+	}
+	
+	mutex_unlock(&swap_sp->swap_space_mutex);
+}
+
+
+/*
+This function gives new_pid its own copy of everything swap space holds for the nr_pages pages of pid from virtual_addr, used by fork
+Returns -SWAP_SPACE_ERROR if swap space ran out of slots
+*/
+
+int swap_dup_range(pid_t pid, pid_t new_pid, uintptr_t virtual_addr, uintptr_t nr_pages)
+{
+	struct swap_block * s_block;
+	struct swap_block * new_block;
+	struct swap_sf_entry * sf_entry;
+	struct swap_sf_entry * new_sf_entry;
+	int err = 0;
+	
+	mutex_lock(&swap_sp->swap_space_mutex);
+	
+	for(uintptr_t i = 0; i < nr_pages && !err; i++)
+	{
+		uintptr_t addr = virtual_addr + (i << 12);
+		
+		if(swap_space_empty_locked())
+		{
+			break;
+		}
+		
+		if( (sf_entry = swap_sf_lookup_locked(pid, addr)) )
+		{
+			new_sf_entry = kmem_cache_alloc(swap_sp->sf_cache, GFP_KERNEL);
+			if(!new_sf_entry)
+			{
+				err = -ERROR_ALLOCATING_MEMORY;
+				break;
+			}
 			
-			if(err)
+			new_sf_entry->pid = new_pid;
+			new_sf_entry->virtual_pframe_addr = addr;
+			new_sf_entry->value = sf_entry->value;
+			hash_add(swap_sp->sf_hash, &new_sf_entry->sf_hash_link, swap_key(new_pid, addr));
+			swap_sp->nr_same_filled++;
+			continue;
+		}
+		
+		if(zswap)
+		{
+			err = mm_zswap_dup_locked(pid, addr, new_pid);
+			if(err != -SWAP_SPACE_ERROR)
 			{
-				// Improv : call free_page
-				return err;
+				continue;
 			}
-			else
+			err = 0;
+		}
+		
+		hash_for_each_possible(swap_sp->swap_hash, s_block, ss_hash_link, swap_key(pid, addr))
+		{
+			if(s_block->pid != pid || s_block->virtual_pframe_addr != addr)
 			{
-				mutex_lock(&mem->mm_memory_mutex);
-				
-				p_frame->virtual_start_address = m_data->virtual_pframe_addr;
-				p_frame->pid = m_data->pid;
-				memcpy((void *)p_frame->physical_start_address, s_block->data, PAGE_SIZE_EXP);
-				
-				mutex_unlock(&mem->mm_memory_mutex);
+				continue;
 			}
 			
-			list_del(&s_block->ss_link);
-			
-			kfree(s_block->data);
-			kfree(s_block);
+			new_block = swap_slot_alloc_locked();
+			if(!new_block)
+			{
+				printk(KERN_ERR "mm_management : Swap space is full\n");
+				err = -SWAP_SPACE_ERROR;
+				break;
+			}
 			
-			return 0;
+			memcpy(new_block->data, s_block->data, PAGE_SIZE_EXP);
+			new_block->pid = new_pid;
+			new_block->virtual_pframe_addr = addr;
+			swap_block_insert_locked(new_block);
+			break;
 		}
 	}
 	
-	return -SWAP_SPACE_ERROR;
+	mutex_unlock(&swap_sp->swap_space_mutex);
+	
+	return err;
+}
+
+
+/*
+This function brings the swapped out page of (pid, virtual_pframe_addr) back into a free frame and maps it again
+The page is found through the swap hashes, so the cost does not depend on how many pages are in swap space
+The stored copy is only dropped once the page is mapped, so a concurrent fault on the same address brings it in too instead of
+taking it for a lazily reserved page that was never touched, whichever fault maps the page first wins and the other frees its frame
+Until the copy is dropped the frame holds a second reference, so that reclaim cannot evict it again and store a second copy meanwhile
+A page brought in by readahead is marked PF_READAHEAD so that its first access can be counted as a hit
+Returns -SWAP_SPACE_ERROR if the page is not in swap space, and 0 if a concurrent fault mapped it first
+*/
+
+static int swap_in_page(struct mm_physical_memory * mem, pid_t pid, uintptr_t virtual_pframe_addr, bool readahead)
+{
+	struct mm_address_space * as = mm_find_address_space(mem, pid);
+	struct mm_page_frame * p_frame;
+	int err;
+	
+	if(!as)
+	{
+		return -SWAP_SPACE_ERROR;
+	}
+	
+	// Checked before allocating, readahead asks for every address of its window
+	mutex_lock(&swap_sp->swap_space_mutex);
+	err = swap_read_locked(pid, virtual_pframe_addr, NULL);
+	mutex_unlock(&swap_sp->swap_space_mutex);
+	
+	if(err)
+	{
+		return err;
+	}
+	
+	// swap_space_mutex is not held here since allocating the frame may have to swap out another page
+	p_frame = get_free_page_internal(mem, 0);
+	if(!p_frame)
+	{
+		return -NO_PAGE_FRAME_AVAILABLE;
+	}
+	atomic_inc(&p_frame->pf_refcount);
+	
+	// An unmap may have dropped the copy meanwhile
+	mutex_lock(&swap_sp->swap_space_mutex);
+	err = swap_read_locked(pid, virtual_pframe_addr, (void *)p_frame->physical_start_address);
+	mutex_unlock(&swap_sp->swap_space_mutex);
+	
+	p_frame->virtual_start_address = virtual_pframe_addr;
+	p_frame->pid = pid;
+	
+	if(!err)
+	{
+		err = update_page_table(mem, as, virtual_pframe_addr, p_frame->physical_start_address);
+	}
+	if(err)
+	{
+		free_page_internal(mem, p_frame->physical_start_address, 0);
+		return err == -PAGE_ALREADY_MAPPED ? 0 : err;
+	}
+	
+	atomic_long_inc(&as->nr_mapped_pages);
+	
+	if(readahead)
+	{
+		spin_lock(&mem->lru_lock);
+		p_frame->pf_flags = p_frame->pf_flags | PF_READAHEAD;
+		spin_unlock(&mem->lru_lock);
+	}
+	
+	mutex_lock(&swap_sp->swap_space_mutex);
+	swap_drop_locked(pid, virtual_pframe_addr);
+	mutex_unlock(&swap_sp->swap_space_mutex);
+	
+	mm_put_page(mem, p_frame);
+	
+	return 0;
+}
+
+
+/*
+This function counts the first access to a page brought in by readahead, it is called from the page table walk that resolves the page
+*/
+
+void swap_ra_hit(struct mm_physical_memory * mem, struct mm_page_frame * p_frame)
+{
+	spin_lock(&mem->lru_lock);
+	if(p_frame->pf_flags & PF_READAHEAD)
+	{
+		p_frame->pf_flags = p_frame->pf_flags & ~PF_READAHEAD;
+		atomic_inc(&swap_sp->ra_hits);
+		atomic64_inc(&swap_sp->ra_hits_total);
+	}
+	spin_unlock(&mem->lru_lock);
 }
 
 
+/*
+This function sizes the readahead window for a swap-in fault at virtual_pframe_addr the way Linux sizes its swap readahead
+The window grows with the readahead hits since the previous fault, and without hits is only kept open for a fault next to the previous one
+It never shrinks to less than half the previous window at once
+Caller must hold swap_space_mutex
+*/
 
+static unsigned int swap_ra_window_locked(uintptr_t virtual_pframe_addr)
+{
+	unsigned int hits = atomic_xchg(&swap_sp->ra_hits, 0);
+	unsigned int pages = hits + 2;
+	
+	if(swap_sp->ra_max_pages <= 1)
+	{
+		return 1;
+	}
+	
+	if(pages == 2)
+	{
+		if(virtual_pframe_addr != swap_sp->ra_prev_addr + PAGE_SIZE_EXP && virtual_pframe_addr + PAGE_SIZE_EXP != swap_sp->ra_prev_addr)
+		{
+			pages = 1;
+		}
+	}
+	else
+	{
+		pages = roundup_pow_of_two(pages);
+	}
+	
+	pages = min(pages, swap_sp->ra_max_pages);
+	pages = max(pages, swap_sp->ra_prev_win / 2);
+	
+	swap_sp->ra_prev_win = pages;
+	swap_sp->ra_prev_addr = virtual_pframe_addr;
+	
+	return pages;
+}
+
+
+/*
+This function handles a swap-in fault: the faulting page is brought back and then the other swapped out pages of the same pid
+in the naturally aligned window of ra_pages pages around it
+Readahead stops once free frames drop to the low watermark, it never reclaims to make room for itself
+*/
+
+int get_swap_space_data(struct mm_physical_memory * mem, void * meta_data)
+{
+	struct swap_meta_data * m_data = (struct swap_meta_data *)meta_data;
+	unsigned int ra_pages;
+	uintptr_t ra_start;
+	int err;
+	
+	mutex_lock(&swap_sp->swap_space_mutex);
+	ra_pages = swap_ra_window_locked(m_data->virtual_pframe_addr);
+	mutex_unlock(&swap_sp->swap_space_mutex);
+	
+	err = swap_in_page(mem, m_data->pid, m_data->virtual_pframe_addr, 0);
+	if(err)
+	{
+		return err;
+	}
+	
+	atomic_long_inc(&mm_find_address_space(mem, m_data->pid)->nr_faults);
+	
+	ra_start = m_data->virtual_pframe_addr & ~(((uintptr_t)ra_pages << 12) - 1);
+	
+	for(uintptr_t i = 0; i < ra_pages; i++)
+	{
+		uintptr_t addr = ra_start + (i << 12);
+		
+		if(addr == m_data->virtual_pframe_addr)
+		{
+			continue;
+		}
+		
+		if(READ_ONCE(mem->nr_free_pages) <= mem->wmark_low)
+		{
+			break;
+		}
+		
+		if(!swap_in_page(mem, m_data->pid, addr, 1))
+		{
+			atomic64_inc(&swap_sp->ra_pages);
+		}
+	}
+	
+	return 0;
+}
@@ -0,0 +1,224 @@
+#include "../include/mm_tlb.h"
+
+/*
+This function allocates the simulated TLB of mem
+Parameters :
+nr_entries : total number of translations the TLB can hold
+nr_ways : associativity, nr_entries / nr_ways is rounded down to a power of two sets
+*/
+
+int mm_tlb_init(struct mm_physical_memory * mem, unsigned int nr_entries, unsigned int nr_ways)
+{
+	struct mm_tlb * tlb;
+	
+	if(!nr_ways || nr_entries < nr_ways)
+	{
+		printk(KERN_ERR "mm_management : Invalid TLB geometry, entries:%u, ways:%u\n", nr_entries, nr_ways);
+		return -INVALID_INPUT;
+	}
+	
+	tlb = kmalloc( sizeof(struct mm_tlb), GFP_KERNEL);
+	if(!tlb)
+	{
+		printk(KERN_ERR "mm_management : Error allocating struct mm_tlb\n");
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	tlb->nr_sets = rounddown_pow_of_two(nr_entries / nr_ways);
+	tlb->nr_ways = nr_ways;
+	
+	tlb->entries = kcalloc(tlb->nr_sets * tlb->nr_ways, sizeof(struct mm_tlb_entry), GFP_KERNEL);
+	tlb->next_victim = kcalloc(tlb->nr_sets, sizeof(unsigned int), GFP_KERNEL);
+	if(!tlb->entries || !tlb->next_victim)
+	{
+		printk(KERN_ERR "mm_management : Error allocating TLB entries\n");
+		kfree(tlb->entries);
+		kfree(tlb->next_victim);
+		kfree(tlb);
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	spin_lock_init(&tlb->lock);
+	atomic64_set(&tlb->hits, 0);
+	atomic64_set(&tlb->misses, 0);
+	atomic64_set(&tlb->shootdowns, 0);
+	
+	mem->tlb = tlb;
+	
+	printk("mm_management : TLB : %u sets x %u ways\n", tlb->nr_sets, tlb->nr_ways);
+	return 0;
+}
+
+
+void mm_tlb_uninit(struct mm_physical_memory * mem)
+{
+	if(!mem->tlb)
+	{
+		return;
+	}
+	
+	kfree(mem->tlb->entries);
+	kfree(mem->tlb->next_victim);
+	kfree(mem->tlb);
+	mem->tlb = NULL;
+}
+
+
+static inline struct mm_tlb_entry * tlb_set(struct mm_tlb * tlb, uintptr_t vfn)
+{
+	return &tlb->entries[(vfn & (tlb->nr_sets - 1)) * tlb->nr_ways];
+}
+
+
+/*
+This function looks up the translation of (pid, vfn)
+A write only hits an entry cached by an earlier write, so writes to copy-on-write pages always reach the page tables
+Returns true and stores the physical frame number in (* pfn) on a hit
+*/
+
+bool mm_tlb_lookup(struct mm_tlb * tlb, pid_t pid, uintptr_t vfn, bool write, uintptr_t * pfn)
+{
+	struct mm_tlb_entry * set = tlb_set(tlb, vfn);
+	bool hit = false;
+	
+	spin_lock(&tlb->lock);
+	for(unsigned int way = 0; way < tlb->nr_ways; way++)
+	{
+		if(set[way].valid && set[way].vfn == vfn && set[way].pid == pid && (set[way].writable || !write))
+		{
+			*pfn = set[way].pfn;
+			hit = true;
+			break;
+		}
+	}
+	spin_unlock(&tlb->lock);
+	
+	if(hit)
+	{
+		atomic64_inc(&tlb->hits);
+	}
+	else
+	{
+		atomic64_inc(&tlb->misses);
+	}
+	
+	return hit;
+}
+
+
+/*
+This function caches the translation of (pid, vfn) after a page table walk
+An invalid way of the set is used if there is one, otherwise the ways are replaced round robin
+*/
+
+void mm_tlb_insert(struct mm_tlb * tlb, pid_t pid, uintptr_t vfn, uintptr_t pfn, bool writable)
+{
+	uintptr_t set_index = vfn & (tlb->nr_sets - 1);
+	struct mm_tlb_entry * set = &tlb->entries[set_index * tlb->nr_ways];
+	struct mm_tlb_entry * entry = NULL;
+	
+	spin_lock(&tlb->lock);
+	for(unsigned int way = 0; way < tlb->nr_ways; way++)
+	{
+		if(!set[way].valid || (set[way].vfn == vfn && set[way].pid == pid))
+		{
+			entry = &set[way];
+			break;
+		}
+	}
+	
+	if(!entry)
+	{
+		entry = &set[tlb->next_victim[set_index]];
+		tlb->next_victim[set_index] = (tlb->next_victim[set_index] + 1) % tlb->nr_ways;
+	}
+	
+	entry->pid = pid;
+	entry->vfn = vfn;
+	entry->pfn = pfn;
+	entry->valid = true;
+	entry->writable = writable;
+	spin_unlock(&tlb->lock);
+}
+
+
+/*
+This function shoots down the cached translation of vfn for pid, or for every pid if pid is MM_TLB_ALL_PIDS
+*/
+
+void mm_tlb_flush_page(struct mm_tlb * tlb, pid_t pid, uintptr_t vfn)
+{
+	struct mm_tlb_entry * set = tlb_set(tlb, vfn);
+	
+	spin_lock(&tlb->lock);
+	for(unsigned int way = 0; way < tlb->nr_ways; way++)
+	{
+		if(set[way].valid && set[way].vfn == vfn && (pid == MM_TLB_ALL_PIDS || set[way].pid == pid))
+		{
+			set[way].valid = false;
+		}
+	}
+	spin_unlock(&tlb->lock);
+	
+	atomic64_inc(&tlb->shootdowns);
+}
+
+
+/*
+This function shoots down the cached translations of nr_pages consecutive pages starting at vfn in one pass
+Small ranges only visit their own sets, ranges larger than the TLB scan every entry once
+*/
+
+void mm_tlb_flush_range(struct mm_tlb * tlb, pid_t pid, uintptr_t vfn, uintptr_t nr_pages)
+{
+	struct mm_tlb_entry * entry;
+	
+	spin_lock(&tlb->lock);
+	if(nr_pages < tlb->nr_sets)
+	{
+		for(uintptr_t i = 0; i < nr_pages; i++)
+		{
+			entry = tlb_set(tlb, vfn + i);
+			for(unsigned int way = 0; way < tlb->nr_ways; way++)
+			{
+				if(entry[way].valid && entry[way].vfn == vfn + i && (pid == MM_TLB_ALL_PIDS || entry[way].pid == pid))
+				{
+					entry[way].valid = false;
+				}
+			}
+		}
+	}
+	else
+	{
+		for(unsigned int i = 0; i < tlb->nr_sets * tlb->nr_ways; i++)
+		{
+			entry = &tlb->entries[i];
+			if(entry->valid && entry->vfn - vfn < nr_pages && (pid == MM_TLB_ALL_PIDS || entry->pid == pid))
+			{
+				entry->valid = false;
+			}
+		}
+	}
+	spin_unlock(&tlb->lock);
+	
+	atomic64_inc(&tlb->shootdowns);
+}
+
+
+void mm_tlb_flush_all(struct mm_tlb * tlb)
+{
+	spin_lock(&tlb->lock);
+	for(unsigned int i = 0; i < tlb->nr_sets * tlb->nr_ways; i++)
+	{
+		tlb->entries[i].valid = false;
+	}
+	spin_unlock(&tlb->lock);
+	
+	atomic64_inc(&tlb->shootdowns);
+}
+
+
+void mm_tlb_print_stats(struct mm_tlb * tlb)
+{
+	printk("mm_management : TLB : hits:%lld, misses:%lld, shootdowns:%lld\n", (long long)atomic64_read(&tlb->hits), (long long)atomic64_read(&tlb->misses), (long long)atomic64_read(&tlb->shootdowns));
+}
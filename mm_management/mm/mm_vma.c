@@ -0,0 +1,392 @@
+#include "../include/mm_vma.h"
+
+/*
+Virtual address range allocator of an address space
+Reserved ranges are kept as VMAs in an rbtree for lookups and in an address ordered list for walking the holes between them
+A free range is searched next fit from free_area_cache, restarting first fit from MM_VMA_BASE when the search reaches MM_VMA_END
+or when cached_hole_size says a large enough hole was passed below the cursor, and unmapping moves the cursor down to the freed range
+so that freed addresses are reused before the address space grows
+Everything is protected by mm_address_space.va_lock
+*/
+
+
+static struct mm_vma * vma_next(struct mm_address_space * as, struct mm_vma * vma)
+{
+	return list_is_last(&vma->vm_link, &as->vma_list) ? NULL : list_next_entry(vma, vm_link);
+}
+
+
+/*
+This function finds the first VMA that ends above addr
+Caller must hold va_lock
+Returns NULL if every VMA ends at or below addr
+*/
+
+static struct mm_vma * find_vma_locked(struct mm_address_space * as, uintptr_t addr)
+{
+	struct rb_node * node = as->vma_tree.rb_node;
+	struct mm_vma * found = NULL;
+	
+	while(node)
+	{
+		struct mm_vma * vma = rb_entry(node, struct mm_vma, vm_rb);
+		
+		if(vma->vm_end > addr)
+		{
+			found = vma;
+			if(vma->vm_start <= addr)
+			{
+				break;
+			}
+			node = node->rb_left;
+		}
+		else
+		{
+			node = node->rb_right;
+		}
+	}
+	
+	return found;
+}
+
+
+static void vma_link_locked(struct mm_address_space * as, struct mm_vma * vma, struct mm_vma * prev)
+{
+	struct rb_node ** link = &as->vma_tree.rb_node;
+	struct rb_node * parent = NULL;
+	
+	while(*link)
+	{
+		parent = *link;
+		if(vma->vm_start < rb_entry(parent, struct mm_vma, vm_rb)->vm_start)
+		{
+			link = &parent->rb_left;
+		}
+		else
+		{
+			link = &parent->rb_right;
+		}
+	}
+	
+	rb_link_node(&vma->vm_rb, parent, link);
+	rb_insert_color(&vma->vm_rb, &as->vma_tree);
+	list_add(&vma->vm_link, prev ? &prev->vm_link : &as->vma_list);
+	as->nr_vmas++;
+}
+
+
+static void vma_unlink_locked(struct mm_address_space * as, struct mm_vma * vma)
+{
+	rb_erase(&vma->vm_rb, &as->vma_tree);
+	list_del(&vma->vm_link);
+	as->nr_vmas--;
+}
+
+
+/*
+This function finds a free range of len bytes aligned to align
+Caller must hold va_lock
+Returns -NO_VIRTUAL_SPACE_AVAILABLE if no hole between MM_VMA_BASE and MM_VMA_END is large enough
+*/
+
+static int get_unmapped_area_locked(struct mm_address_space * as, uintptr_t len, uintptr_t align, uintptr_t * addr_out)
+{
+	struct mm_vma * vma;
+	uintptr_t start;
+	uintptr_t addr;
+	
+	if(len <= as->cached_hole_size)
+	{
+		start = MM_VMA_BASE;
+		as->cached_hole_size = 0;
+	}
+	else
+	{
+		start = as->free_area_cache;
+	}
+	
+full_search:
+	addr = ALIGN(start, align);
+	vma = find_vma_locked(as, addr);
+	
+	while(1)
+	{
+		if(addr + len > MM_VMA_END || addr + len < addr)
+		{
+			// Holes below the cursor may have been missed, search the whole space once
+			if(start != MM_VMA_BASE)
+			{
+				start = MM_VMA_BASE;
+				as->cached_hole_size = 0;
+				goto full_search;
+			}
+			return -NO_VIRTUAL_SPACE_AVAILABLE;
+		}
+		
+		if(!vma || addr + len <= vma->vm_start)
+		{
+			as->free_area_cache = addr + len;
+			*addr_out = addr;
+			return 0;
+		}
+		
+		if(addr + as->cached_hole_size < vma->vm_start)
+		{
+			as->cached_hole_size = vma->vm_start - addr;
+		}
+		
+		addr = ALIGN(vma->vm_end, align);
+		vma = vma_next(as, vma);
+	}
+}
+
+
+/*
+This function reserves [addr, addr + len), which must be free, merging it into the VMAs next to it when they touch it and have the same vm_flags
+new_vma is only linked in when the range cannot be merged into either neighbour
+Caller must hold va_lock
+Returns true if new_vma was used
+*/
+
+static bool vma_insert_locked(struct mm_address_space * as, uintptr_t addr, uintptr_t len, unsigned long vm_flags, struct mm_vma * new_vma)
+{
+	struct mm_vma * next = find_vma_locked(as, addr);
+	struct mm_vma * prev;
+	
+	if(next)
+	{
+		prev = list_is_first(&next->vm_link, &as->vma_list) ? NULL : list_prev_entry(next, vm_link);
+	}
+	else
+	{
+		prev = list_empty(&as->vma_list) ? NULL : list_last_entry(&as->vma_list, struct mm_vma, vm_link);
+	}
+	
+	if(prev && prev->vm_end == addr && prev->vm_flags == vm_flags)
+	{
+		prev->vm_end = addr + len;
+		
+		if(next && next->vm_start == prev->vm_end && next->vm_flags == vm_flags)
+		{
+			prev->vm_end = next->vm_end;
+			vma_unlink_locked(as, next);
+			kfree(next);
+		}
+		return false;
+	}
+	
+	// vm_start only moves down into a hole, so the position of next in the tree stays the same
+	if(next && next->vm_start == addr + len && next->vm_flags == vm_flags)
+	{
+		next->vm_start = addr;
+		return false;
+	}
+	
+	new_vma->vm_start = addr;
+	new_vma->vm_end = addr + len;
+	new_vma->vm_flags = vm_flags;
+	vma_link_locked(as, new_vma, prev);
+	
+	return true;
+}
+
+
+/*
+This function reserves a free range of nr_pages pages aligned to align bytes in the address space as
+Pages in the range are not mapped, the caller maps them afterwards unless vm_flags has MM_VM_LAZY
+Returns the starting virtual address of the range in (* addr)
+*/
+
+int mm_mmap(struct mm_address_space * as, uintptr_t nr_pages, uintptr_t align, unsigned long vm_flags, uintptr_t * addr)
+{
+	uintptr_t len = nr_pages << 12;
+	struct mm_vma * new_vma;
+	int err;
+	
+	if( !nr_pages || nr_pages > (MM_VMA_END >> 12) || !is_power_of_2(align) || align < 0x01000 )
+	{
+		printk(KERN_ERR "mm_management : Invalid range given to mm_mmap(), pages:%lu, align:%lx\n", nr_pages, align);
+		return -INVALID_INPUT;
+	}
+	
+	// Allocated up front since va_lock is a spinlock, freed again if the range merges into a neighbour
+	new_vma = kmalloc( sizeof(struct mm_vma), GFP_KERNEL);
+	if(!new_vma)
+	{
+		printk(KERN_ERR "mm_management : Error allocating struct mm_vma\n");
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	spin_lock(&as->va_lock);
+	
+	err = get_unmapped_area_locked(as, len, align, addr);
+	if(!err && vma_insert_locked(as, *addr, len, vm_flags, new_vma))
+	{
+		new_vma = NULL;
+	}
+	
+	spin_unlock(&as->va_lock);
+	
+	kfree(new_vma);
+	
+	if(err)
+	{
+		printk(KERN_ERR "mm_management : No free virtual range of %lu pages in the address space of pid:%d\n", nr_pages, as->pid);
+	}
+	
+	return err;
+}
+
+
+/*
+This function releases the reservation of nr_pages pages from addr so the range can be handed out again
+A VMA that only partly overlaps the range is trimmed, one that contains it is split in two
+Parts of the range that are not reserved are ignored
+The pages must already be unmapped
+*/
+
+int mm_munmap(struct mm_address_space * as, uintptr_t addr, uintptr_t nr_pages)
+{
+	uintptr_t end = addr + (nr_pages << 12);
+	struct mm_vma * vma;
+	struct mm_vma * next;
+	struct mm_vma * new_vma;
+	
+	if( (addr & 0x0000000000000FFF) || !nr_pages || end > MM_VMA_END || end < addr )
+	{
+		printk(KERN_ERR "mm_management : Invalid range given to mm_munmap(), addr:%lx, pages:%lu\n", addr, nr_pages);
+		return -INVALID_INPUT;
+	}
+	
+	// Only needed when a VMA is split
+	new_vma = kmalloc( sizeof(struct mm_vma), GFP_KERNEL);
+	if(!new_vma)
+	{
+		printk(KERN_ERR "mm_management : Error allocating struct mm_vma\n");
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	spin_lock(&as->va_lock);
+	
+	for(vma = find_vma_locked(as, addr); vma && vma->vm_start < end; vma = next)
+	{
+		next = vma_next(as, vma);
+		
+		if(vma->vm_start < addr && vma->vm_end > end)
+		{
+			new_vma->vm_start = end;
+			new_vma->vm_end = vma->vm_end;
+			new_vma->vm_flags = vma->vm_flags;
+			vma->vm_end = addr;
+			vma_link_locked(as, new_vma, vma);
+			new_vma = NULL;
+			break;
+		}
+		
+		if(vma->vm_start < addr)
+		{
+			vma->vm_end = addr;
+		}
+		else if(vma->vm_end > end)
+		{
+			vma->vm_start = end;
+		}
+		else
+		{
+			vma_unlink_locked(as, vma);
+			kfree(vma);
+		}
+	}
+	
+	if(addr < as->free_area_cache)
+	{
+		as->free_area_cache = addr;
+	}
+	
+	spin_unlock(&as->va_lock);
+	
+	kfree(new_vma);
+	
+	return 0;
+}
+
+
+/*
+This function finds the VMA containing addr and returns its vm_flags in (* vm_flags)
+Returns -WRONG_VALUE if addr is not reserved
+*/
+
+int mm_vma_lookup_flags(struct mm_address_space * as, uintptr_t addr, unsigned long * vm_flags)
+{
+	struct mm_vma * vma;
+	int err = -WRONG_VALUE;
+	
+	spin_lock(&as->va_lock);
+	
+	vma = find_vma_locked(as, addr);
+	if(vma && vma->vm_start <= addr)
+	{
+		*vm_flags = vma->vm_flags;
+		err = 0;
+	}
+	
+	spin_unlock(&as->va_lock);
+	
+	return err;
+}
+
+
+/*
+This function copies every VMA of src into dst, which has none yet, for fork
+src is the address space of current and only current changes its VMAs, so they are read without its va_lock
+*/
+
+int mm_vma_dup(struct mm_address_space * dst, struct mm_address_space * src)
+{
+	struct mm_vma * vma;
+	struct mm_vma * new_vma;
+	
+	list_for_each_entry(vma, &src->vma_list, vm_link)
+	{
+		new_vma = kmalloc( sizeof(struct mm_vma), GFP_KERNEL);
+		if(!new_vma)
+		{
+			printk(KERN_ERR "mm_management : Error allocating struct mm_vma\n");
+			return -ERROR_ALLOCATING_MEMORY;
+		}
+		
+		new_vma->vm_start = vma->vm_start;
+		new_vma->vm_end = vma->vm_end;
+		new_vma->vm_flags = vma->vm_flags;
+		
+		spin_lock(&dst->va_lock);
+		vma_link_locked(dst, new_vma, list_empty(&dst->vma_list) ? NULL : list_last_entry(&dst->vma_list, struct mm_vma, vm_link));
+		spin_unlock(&dst->va_lock);
+	}
+	
+	spin_lock(&dst->va_lock);
+	dst->free_area_cache = src->free_area_cache;
+	dst->cached_hole_size = src->cached_hole_size;
+	spin_unlock(&dst->va_lock);
+	
+	return 0;
+}
+
+
+/*
+This function frees every VMA of as when its address space is freed
+*/
+
+void mm_vma_uninit(struct mm_address_space * as)
+{
+	struct mm_vma *vma, *temp_vma;
+	
+	list_for_each_entry_safe(vma, temp_vma, &as->vma_list, vm_link)
+	{
+		kfree(vma);
+	}
+	
+	INIT_LIST_HEAD(&as->vma_list);
+	as->vma_tree = RB_ROOT;
+	as->nr_vmas = 0;
+}
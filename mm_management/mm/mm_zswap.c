@@ -0,0 +1,277 @@
+#include <linux/lz4.h>
+#include <linux/ktime.h>
+#include <linux/vmalloc.h>
+#include "../include/mm_swap_space.h"
+#include "../include/mm_zswap.h"
+
+struct mm_zswap * zswap = NULL;
+
+static const char * zswap_class_names[MM_ZSWAP_NR_CLASSES] = {
+	"mm_zswap_256", "mm_zswap_512", "mm_zswap_768", "mm_zswap_1024",
+	"mm_zswap_1280", "mm_zswap_1536", "mm_zswap_1792", "mm_zswap_2048",
+};
+
+/*
+This function sets up the compressed swap tier, one kmem_cache per size class and the compression buffers
+*/
+
+int mm_zswap_init(void)
+{
+	zswap = kzalloc( sizeof(struct mm_zswap), GFP_KERNEL);
+	if(!zswap)
+	{
+		printk(KERN_ERR "mm_management : Error allocating struct mm_zswap\n");
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	zswap->workmem = vmalloc(LZ4_MEM_COMPRESS);
+	zswap->buffer = kmalloc(MM_ZSWAP_MAX_LENGTH, GFP_KERNEL);
+	if(!zswap->workmem || !zswap->buffer)
+	{
+		printk(KERN_ERR "mm_management : Error allocating zswap compression buffers\n");
+		mm_zswap_uninit();
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	for(int i = 0; i < MM_ZSWAP_NR_CLASSES; i++)
+	{
+		zswap->classes[i] = kmem_cache_create(zswap_class_names[i], sizeof(struct zswap_entry) + (i + 1) * MM_ZSWAP_CLASS_SIZE, 0, 0, NULL);
+		if(!zswap->classes[i])
+		{
+			printk(KERN_ERR "mm_management : Error creating zswap size class %s\n", zswap_class_names[i]);
+			mm_zswap_uninit();
+			return -ERROR_ALLOCATING_MEMORY;
+		}
+	}
+	
+	hash_init(zswap->z_hash);
+	atomic64_set(&zswap->nr_loads, 0);
+	atomic64_set(&zswap->decompress_ns, 0);
+	
+	return 0;
+}
+
+
+void mm_zswap_uninit(void)
+{
+	struct zswap_entry * entry;
+	struct hlist_node * temp;
+	int bkt;
+	
+	if(!zswap)
+	{
+		return;
+	}
+	
+	hash_for_each_safe(zswap->z_hash, bkt, temp, entry, z_hash_link)
+	{
+		hash_del(&entry->z_hash_link);
+		mm_zswap_free_entry(entry);
+	}
+	
+	for(int i = 0; i < MM_ZSWAP_NR_CLASSES; i++)
+	{
+		kmem_cache_destroy(zswap->classes[i]);
+	}
+	
+	kfree(zswap->buffer);
+	vfree(zswap->workmem);
+	kfree(zswap);
+	zswap = NULL;
+}
+
+
+/*
+This function compresses the page at src and stores it as the compressed copy of (pid, virtual_pframe_addr)
+Caller must hold swap_space_mutex
+Returns an error if the page does not compress below MM_ZSWAP_MAX_LENGTH or no entry can be had without sleeping, the caller then falls back to a swap slot
+*/
+
+int mm_zswap_store_locked(pid_t pid, uintptr_t virtual_pframe_addr, const void * src)
+{
+	struct zswap_entry * entry;
+	ktime_t start = ktime_get();
+	int length;
+	int size_class;
+	
+	length = LZ4_compress_default(src, (char *)zswap->buffer, PAGE_SIZE_EXP, MM_ZSWAP_MAX_LENGTH, zswap->workmem);
+	zswap->compress_ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+	
+	if(length <= 0)
+	{
+		zswap->nr_rejected++;
+		return -SWAP_SPACE_ERROR;
+	}
+	
+	size_class = (length - 1) / MM_ZSWAP_CLASS_SIZE;
+	
+	entry = kmem_cache_alloc(zswap->classes[size_class], GFP_NOWAIT | __GFP_NOWARN);
+	if(!entry)
+	{
+		zswap->nr_alloc_failed++;
+		return -ERROR_ALLOCATING_MEMORY;
+	}
+	
+	entry->pid = pid;
+	entry->virtual_pframe_addr = virtual_pframe_addr;
+	entry->length = length;
+	entry->size_class = size_class;
+	memcpy(entry->data, zswap->buffer, length);
+	
+	mm_zswap_insert_locked(entry);
+	
+	zswap->nr_stored++;
+	zswap->class_count[size_class]++;
+	zswap->original_bytes += PAGE_SIZE_EXP;
+	zswap->compressed_bytes += length;
+	
+	printk("mm_management : PAGE_SWAP : Compressed pid:%d, addr:%lx, %lu -> %d bytes\n", pid, virtual_pframe_addr, (unsigned long)PAGE_SIZE_EXP, length);
+	
+	return 0;
+}
+
+
+/*
+This function drops the compressed copy of (pid, virtual_pframe_addr), rolling back every counter its store raised
+Every removal goes through here: a page brought back in, a range discarded and a store whose eviction failed
+Caller must hold swap_space_mutex
+*/
+
+void mm_zswap_drop_locked(pid_t pid, uintptr_t virtual_pframe_addr)
+{
+	struct zswap_entry * entry = mm_zswap_lookup_locked(pid, virtual_pframe_addr);
+	
+	if(!entry)
+	{
+		return;
+	}
+	
+	hash_del(&entry->z_hash_link);
+	
+	zswap->nr_stored--;
+	zswap->class_count[entry->size_class]--;
+	zswap->original_bytes -= PAGE_SIZE_EXP;
+	zswap->compressed_bytes -= entry->length;
+	
+	mm_zswap_free_entry(entry);
+}
+
+
+void mm_zswap_insert_locked(struct zswap_entry * entry)
+{
+	hash_add(zswap->z_hash, &entry->z_hash_link, swap_key(entry->pid, entry->virtual_pframe_addr));
+}
+
+
+/*
+This function stores a second copy of the compressed page of (pid, virtual_pframe_addr) for (new_pid, virtual_pframe_addr)
+Caller must hold swap_space_mutex
+Returns -SWAP_SPACE_ERROR if the page is not held compressed
+*/
+
+int mm_zswap_dup_locked(pid_t pid, uintptr_t virtual_pframe_addr, pid_t new_pid)
+{
+	struct zswap_entry * entry;
+	struct zswap_entry * new_entry;
+	
+	hash_for_each_possible(zswap->z_hash, entry, z_hash_link, swap_key(pid, virtual_pframe_addr))
+	{
+		if(entry->pid == pid && entry->virtual_pframe_addr == virtual_pframe_addr)
+		{
+			new_entry = kmem_cache_alloc(zswap->classes[entry->size_class], GFP_KERNEL);
+			if(!new_entry)
+			{
+				zswap->nr_alloc_failed++;
+				return -ERROR_ALLOCATING_MEMORY;
+			}
+			
+			memcpy(new_entry, entry, sizeof(struct zswap_entry) + entry->length);
+			new_entry->pid = new_pid;
+			mm_zswap_insert_locked(new_entry);
+			
+			zswap->nr_stored++;
+			zswap->class_count[entry->size_class]++;
+			zswap->original_bytes += PAGE_SIZE_EXP;
+			zswap->compressed_bytes += entry->length;
+			
+			return 0;
+		}
+	}
+	
+	return -SWAP_SPACE_ERROR;
+}
+
+
+/*
+This function finds the compressed copy of (pid, virtual_pframe_addr) and leaves it in the compressed tier
+Caller must hold swap_space_mutex
+Returns NULL if the page is not held compressed
+*/
+
+struct zswap_entry * mm_zswap_lookup_locked(pid_t pid, uintptr_t virtual_pframe_addr)
+{
+	struct zswap_entry * entry;
+	
+	hash_for_each_possible(zswap->z_hash, entry, z_hash_link, swap_key(pid, virtual_pframe_addr))
+	{
+		if(entry->pid == pid && entry->virtual_pframe_addr == virtual_pframe_addr)
+		{
+			return entry;
+		}
+	}
+	
+	return NULL;
+}
+
+
+/*
+This function decompresses an entry into the page at dst
+Caller must hold swap_space_mutex, which keeps the entry from being dropped meanwhile
+*/
+
+int mm_zswap_load(struct zswap_entry * entry, void * dst)
+{
+	ktime_t start = ktime_get();
+	int length = LZ4_decompress_safe((const char *)entry->data, dst, entry->length, PAGE_SIZE_EXP);
+	
+	atomic64_add(ktime_to_ns(ktime_sub(ktime_get(), start)), &zswap->decompress_ns);
+	atomic64_inc(&zswap->nr_loads);
+	
+	if(length != PAGE_SIZE_EXP)
+	{
+		printk(KERN_ERR "mm_management : Error decompressing pid:%d, addr:%lx\n", entry->pid, entry->virtual_pframe_addr);
+		return -SWAP_SPACE_ERROR;
+	}
+	
+	return 0;
+}
+
+
+/*
+This function frees an entry that is no longer reachable through the hash
+The stored counters are only touched under swap_space_mutex, so they are left to the caller
+*/
+
+void mm_zswap_free_entry(struct zswap_entry * entry)
+{
+	kmem_cache_free(zswap->classes[entry->size_class], entry);
+}
+
+
+void mm_zswap_print_stats(void)
+{
+	if(!zswap)
+	{
+		return;
+	}
+	
+	printk("mm_management : ZSWAP : stored:%lu, rejected:%lu, alloc failed:%lu, original bytes:%llu, compressed bytes:%llu, compress ns:%llu\n",
+		zswap->nr_stored, zswap->nr_rejected, zswap->nr_alloc_failed,
+		(unsigned long long)zswap->original_bytes, (unsigned long long)zswap->compressed_bytes, (unsigned long long)zswap->compress_ns);
+	printk("mm_management : ZSWAP : loads:%lld, decompress ns:%lld\n", (long long)atomic64_read(&zswap->nr_loads), (long long)atomic64_read(&zswap->decompress_ns));
+	
+	for(int i = 0; i < MM_ZSWAP_NR_CLASSES; i++)
+	{
+		printk("mm_management : ZSWAP : class <=%d bytes : %lu entries\n", (i + 1) * MM_ZSWAP_CLASS_SIZE, zswap->class_count[i]);
+	}
+}
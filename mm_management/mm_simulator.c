@@ -4,28 +4,120 @@
 #include <linux/cdev.h>
 #include <asm/uaccess.h>
 #include "include/mm_swap_space.h"
+#include "include/mm_lru.h"
+#include "include/mm_zswap.h"
+#include "include/mm_kswapd.h"
+#include "include/mm_address_space.h"
+#include "include/mm_ksm.h"
 
 MODULE_LICENSE("Dual BSD/GPL");
 
+static unsigned long memory_size = TOTAL_MEMORY_EXP;
+module_param(memory_size, ulong, 0444);
+MODULE_PARM_DESC(memory_size, "Size of the simulated physical memory in bytes, rounded down to whole pages");
+
+static unsigned int page_size = PAGE_SIZE_EXP;
+module_param(page_size, uint, 0444);
+MODULE_PARM_DESC(page_size, "Page size of the simulated memory in bytes, only 4096 is supported");
+
+static unsigned int tlb_entries = MM_TLB_DEFAULT_ENTRIES;
+module_param(tlb_entries, uint, 0444);
+MODULE_PARM_DESC(tlb_entries, "Number of translations held by the simulated TLB");
+
+static unsigned int tlb_ways = MM_TLB_DEFAULT_WAYS;
+module_param(tlb_ways, uint, 0444);
+MODULE_PARM_DESC(tlb_ways, "Associativity of the simulated TLB");
+
+static unsigned long swap_slots = MM_SWAP_DEFAULT_SLOTS;
+module_param(swap_slots, ulong, 0444);
+MODULE_PARM_DESC(swap_slots, "Number of page sized slots preallocated for swap space");
+
+static unsigned int swap_readahead = MM_SWAP_RA_DEFAULT_PAGES;
+module_param(swap_readahead, uint, 0444);
+MODULE_PARM_DESC(swap_readahead, "Largest swap readahead window in pages, rounded down to a power of two, 0 disables readahead");
+
+static bool zswap_enabled = true;
+module_param(zswap_enabled, bool, 0444);
+MODULE_PARM_DESC(zswap_enabled, "Keep evicted pages LZ4 compressed in memory before falling back to swap slots");
+
+static bool ksm_enabled = false;
+module_param(ksm_enabled, bool, 0444);
+MODULE_PARM_DESC(ksm_enabled, "Merge identical pages into one read only frame shared copy-on-write");
+
+static unsigned int ksm_pages_to_scan = MM_KSM_DEFAULT_PAGES_TO_SCAN;
+module_param(ksm_pages_to_scan, uint, 0444);
+MODULE_PARM_DESC(ksm_pages_to_scan, "Number of frames the same page merging scanner checks per pass");
+
+static unsigned int ksm_sleep_ms = MM_KSM_DEFAULT_SLEEP_MS;
+module_param(ksm_sleep_ms, uint, 0444);
+MODULE_PARM_DESC(ksm_sleep_ms, "Milliseconds the same page merging scanner sleeps between passes");
+
 struct mm_physical_memory * mem;
 
 static int initialise_simulator(void)
 {
 	int err;
 	
-	if((err = initialize_memory(mem)) != 0)
+	if((err = initialize_memory(&mem, memory_size, page_size)) != 0)
 	{
 		return err;
 	}
 	
 	if((err = initialize_pframes(mem)) != 0)
 	{
-		return err;
+		goto err_memory;
+	}
+	
+	if((err = mm_tlb_init(mem, tlb_entries, tlb_ways)) != 0)
+	{
+		goto err_memory;
 	}
 	
-	initialise_swap_space();
+	if((err = mm_pwc_init(mem)) != 0)
+	{
+		goto err_tlb;
+	}
+	
+	if((err = initialise_swap_space(swap_slots, swap_readahead)) != 0)
+	{
+		goto err_pwc;
+	}
+	
+	if(zswap_enabled && (err = mm_zswap_init()) != 0)
+	{
+		goto err_swap;
+	}
+	
+	mm_lru_init(mem);
+	
+	if((err = mm_kswapd_init(mem)) != 0)
+	{
+		goto err_lru;
+	}
+	
+	if(ksm_enabled && (err = mm_ksm_init(mem, ksm_pages_to_scan, ksm_sleep_ms)) != 0)
+	{
+		goto err_kswapd;
+	}
 	
 	return 0;
+	
+	// Nothing has been allocated from the simulated memory yet, so no address space or page table free is left to undo
+err_kswapd:
+	mm_kswapd_uninit(mem);
+err_lru:
+	mm_lru_uninit(mem);
+	mm_zswap_uninit();
+err_swap:
+	uninitialise_swap_space();
+err_pwc:
+	mm_pwc_uninit(mem);
+err_tlb:
+	mm_tlb_uninit(mem);
+err_memory:
+	uninitialize_memory(mem);
+	mem = NULL;
+	return err;
 }
 
 static int __init mm_simulator_init(void)
@@ -53,6 +145,15 @@ static int __init mm_simulator_init(void)
 	
 	err = mm_free_page(mem, addr1);
 	
+	mm_tlb_print_stats(mem->tlb);
+	mm_pwc_print_stats(mem->pwc);
+	mm_lru_print_stats(mem);
+	print_swap_stats();
+	mm_zswap_print_stats();
+	mm_kswapd_print_stats(mem);
+	mm_ksm_print_stats();
+	mm_address_spaces_print_stats(mem);
+	
 	//print_list();
 	
 	return 0;
@@ -61,7 +162,16 @@ static int __init mm_simulator_init(void)
 
 static void __exit mm_simulator_exit(void)
 {
-	//uninitialize_memory();
+	mm_ksm_uninit();
+	mm_kswapd_uninit(mem);
+	mm_lru_uninit(mem);
+	mm_zswap_uninit();
+	uninitialise_swap_space();
+	drain_page_table_frees(mem);
+	mm_address_spaces_uninit(mem);
+	mm_pwc_uninit(mem);
+	mm_tlb_uninit(mem);
+	uninitialize_memory(mem);
 	printk("mm_management : mm_management_exit\n");
 }
 